@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/param.h>
+
+#include "estd.h"
+
+/*
+ * Convert an event dump of estd -j to CSV on stdout:
+ *
+ *	estd-events /var/run/estd.events > events.csv
+ *
+ * Reads stdin without an argument.
+ */
+
+static const char *reasons[] = ESTD_EVENT_REASONS;
+
+int
+main(int argc, char *argv[])
+{
+	struct estd_events_header hdr;
+	struct estd_event ev;
+	const char *file = "stdin";
+	char skip[256];
+	size_t n;
+	FILE *fh = stdin;
+
+	if (argc > 2) {
+		fprintf(stderr, "usage: estd-events [event dump]\n");
+		exit(1);
+	}
+	if ((argc == 2) && ((fh = fopen(file = argv[1], "r")) == NULL)) {
+		fprintf(stderr, "estd-events: Cannot open %s: %s\n", file, strerror(errno));
+		exit(1);
+	}
+
+	/* later versions may grow the header and the records at the end */
+	if ((fread(&hdr, sizeof(hdr), 1, fh) != 1) || (hdr.magic != ESTD_EVENTS_MAGIC) ||
+	    (hdr.size < sizeof(hdr)) || (hdr.recsize < sizeof(ev))) {
+		fprintf(stderr, "estd-events: %s is no event dump\n", file);
+		exit(1);
+	}
+	for (n = hdr.size - sizeof(hdr); n > 0; n -= MIN(n, sizeof(skip)))
+		if (fread(skip, MIN(n, sizeof(skip)), 1, fh) != 1)
+			goto truncated;
+
+	printf("seq,time_us,domain,reason,load,old_idx,new_idx,old_mhz,new_mhz\n");
+	while (fread(&ev, sizeof(ev), 1, fh) == 1) {
+		printf("%u,%llu,%d,%s,%d,%d,%d,%u,%u\n", ev.seq, (unsigned long long)ev.time,
+		    ev.domain, (ev.reason < sizeof(reasons) / sizeof(reasons[0])) ?
+		    reasons[ev.reason] : "unknown", ev.load, ev.oldidx, ev.newidx,
+		    ev.oldmhz, ev.newmhz);
+		for (n = hdr.recsize - sizeof(ev); n > 0; n -= MIN(n, sizeof(skip)))
+			if (fread(skip, MIN(n, sizeof(skip)), 1, fh) != 1)
+				goto truncated;
+	}
+	if (ferror(fh)) {
+		fprintf(stderr, "estd-events: Cannot read %s: %s\n", file, strerror(errno));
+		exit(1);
+	}
+	return 0;
+
+ truncated:
+	fprintf(stderr, "estd-events: %s is truncated\n", file);
+	exit(1);
+}
@@ -1,5 +1,6 @@
 /*
- * Enhanced Speedstep & PowerNow Daemon for NetBSD & DragonFly BSD, Code (c) 
+ * Enhanced Speedstep & PowerNow Daemon for NetBSD, DragonFly BSD, OpenBSD &
+ * Linux, Code (c) 
  * 2004-2007 by Ove Soerensen, Portions (c) 2006,2009 Johannes Hofmann, 2007
  * Stephen M. Rumble
  *
@@ -25,6 +26,9 @@
  *
  */
 
+#if defined(__linux__)
+ #define _GNU_SOURCE	/* asprintf() */
+#endif
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -32,25 +36,78 @@
 #include <unistd.h>
 #include <time.h>
 #include <sys/param.h>
-#include <sys/sysctl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#ifdef OVERHEAT_HACK
+#include <pthread.h>
+#include <stdint.h>
+#endif
+#include <stdarg.h>
+#if defined(__linux__)
+ #include <bsd/string.h>
+ #include <bsd/unistd.h>
+ #include <bsd/libutil.h>
+#else
+ #include <sys/sysctl.h>
+#endif
 #if defined(__DragonFly__)
  #include <kinfo.h>
  #include <libutil.h>
-#else
+#elif !defined(__linux__)
  #include <sys/sched.h>
  #include <util.h>
 #endif
 #include <errno.h>
 #include <signal.h>
+#include <dlfcn.h>
+#include <math.h>
+
+#include "estd.h"
 
 #define ESTD_VERSION "Release 11+0"
 #define BATTERY 0
 #define SMOOTH 1
 #define AGGRESSIVE 2
+#define MAX_GOVERNORS 8
 #define DEF_POLL 500000
 #define MIN_POLL 10000
 #define DEF_HIGH 80
 #define DEF_LOW 40
+#define DEF_TARGET 70
+#define SATURATED_LOAD 95	/* capacity: demand beyond this can't be measured */
+#define DEF_KP 1.0
+#define DEF_KI 2.0
+#define DEF_KD 0.0
+#define DEF_HALFLIFE 1000000
+#define CTL_MAXCLIENTS 8
+#define CTL_LINEMAX 256
+#define LEASE_MAX 32		/* active leases over all clients */
+#define METRICS_INTERVAL 15000000	/* us between rewrites of the -F file */
+#define TOPOLOGY_INTERVAL 2000000	/* us between checks for cpu hotplug */
+#define OVERHEAD_INTERVAL 60000000	/* us between overhead summaries */
+#define LOAD_BUCKETS 10		/* decision load histogram, 10% each */
+#define JITTER_BUCKETS 8	/* wakeup lateness histogram, 10us * 4^n */
+#define IDLE_LOAD 5	/* adaptive polling: a domain at minidx below this is idle */
+#define RISE_LOAD 10	/* adaptive polling: load jumps of this much poll faster */
+#define TRACE_MAGIC "ESTDTRC2"
+#define TRACE_MAGIC_V1 "ESTDTRC1"	/* no per-domain thermal state */
+#define TRACE_STATES 5	/* user, nice, sys, intr, idle */
+#define TRACE_MAXFREQS 1024	/* sanity limit when reading a trace */
+
+/* load estimators for -e */
+enum {
+	EST_RAW = 0,
+	EST_EWMA,
+	EST_MAX,
+	EST_P90
+};
 
 enum {
 	TECH_UNKNOWN = 0,
@@ -61,30 +118,53 @@ enum {
 	TECH_LOONGSON,
 	TECH_ROCKCHIP,
 	TECH_OPENBSD,
+	TECH_LINUX,
 	TECH_GENERIC,
 	TECH_MAX
 };
  
 /* this is ugly, but... <shrug> */
-#define MAX_FREQS 32
 #define SYSCTLBUF 255
-#define MAX_CPUS  128
 
 extern char    *optarg;
 extern int      optind;
 
-#if defined(__DragonFly__)
- #define useconds_t unsigned int
+#if defined(__linux__)
+#ifndef _PATH_SYSFS
+#define _PATH_SYSFS "/sys"
+#endif
+#ifndef _PATH_PROCSTAT
+#define _PATH_PROCSTAT "/proc/stat"
+#endif
+#define LINUX_GOVERNOR "userspace"
+#define LINUX_FREQSTEPS 32	/* for drivers without a frequency table */
+/* /proc/stat is folded into the BSD cp_time layout */
+#define CP_USER   0
+#define CP_NICE   1
+#define CP_SYS    2
+#define CP_INTR   3
+#define CP_IDLE   4
+#define CPUSTATES 5
 #endif
 
 /* command-line options */
 int             daemonize = 0;
 int             verbose = 0;
 int             nicemod = 0;
-int             strategy = SMOOTH;
-useconds_t      poll = DEF_POLL;
+int             strategy = SMOOTH;	/* index into governors[] */
+const char     *govname;
+useconds_t      pollint = DEF_POLL;
+useconds_t      maxpoll = 0;	/* adaptive polling ceiling, 0 = fixed interval */
 int             high = DEF_HIGH;
 int             low = DEF_LOW;
+int             target = DEF_TARGET;
+double          pid_kp = DEF_KP;
+double          pid_ki = DEF_KI;
+double          pid_kd = DEF_KD;
+int             upest = EST_RAW;
+int             downest = EST_RAW;
+useconds_t      halflife = DEF_HALFLIFE;
+int             loadwindow = LOAD_HIST;
 useconds_t      lowgrace = 0;
 int             minmhz = 0;
 int             maxmhz = INT_MAX;
@@ -93,49 +173,187 @@ int             tech = TECH_UNKNOWN;
 int             use_clockmod = 0;
 int             clockmod_min = -1;
 int             clockmod_max = -1;
+const char     *recordfile;
+const char     *replayfile;
+const char     *mockfile;
+const char     *ctlpath;
+const char     *metricsfile;
+const char     *statusfile;
+const char     *eventfile;
+int             proctitle = 1;	/* -q turns the process title off */
+#if defined(__linux__)
+const char     *sysfsroot = _PATH_SYSFS;	/* -D, for testing against a fake tree */
+#endif
 #ifdef OVERHEAT_HACK
-extern int is_overheat(const char *, double, unsigned int, double *);
+extern int check_overheat(const char *, double, double *);
+extern unsigned long long overheat_calls;	/* made by the backend */
 #define DEF_SENSORPOLL	15	/* check interval is 15 seconds */
-const char      *sensordev;
+const char      *sensordev;		/* -T for domains without their own */
 unsigned int    sensorpoll = DEF_SENSORPOLL;
 double          sensorcrit = 90.0;	/* defaut: 90 degC */
-double          sensorcur;
-#endif
-
-/* a domain is a set of CPUs for which the frequency must be set together */
-struct domain {
-	int         *cpus;
-	int          ncpus;
-	char        *freqctl;
-	char        *setctl;
-	useconds_t   lowtime;
-	int          freqtab[MAX_FREQS];
-	int          freqtab2perf[MAX_FREQS];
-	int          nfreqs;
-	int          minidx;
-	int          maxidx;
-	int          curcpu;
-	int          curfreq;
+double          sensorcur;		/* hottest reading */
+int             sensorhot;
+#define DEF_THERMBAND	10.0	/* degC below sensorcrit where the cap starts */
+#define THERMAL_RELEASE	1000000	/* us per step when the cap is raised again */
+#define DEF_HORIZON	10	/* s to extrapolate the temperature trend */
+#define SENSOR_HIST	8	/* readings kept to estimate the trend */
+#define SENSOR_MINPOLL	500	/* ms between readings right at the limit */
+double          thermband = DEF_THERMBAND;
+unsigned int    thermhorizon = DEF_HORIZON;
+/*
+ * the sensors matching one pattern and their critical temperature, for
+ * one domain (-T N=pattern, -c N=temperature) or all others. The history
+ * belongs to the sensor thread; it publishes the latest reading under a
+ * seqlock, seq is odd while an update is in progress
+ */
+struct sensor {
+	int			domain;		/* -1 for the default, -2 once gone */
+	const char	       *device;
+	double			crit;
+	double			hist_t[SENSOR_HIST];
+	double			hist_deg[SENSOR_HIST];
+	int			pos;
+	int			n;
+	struct timespec		next;		/* of the next reading */
+	_Atomic unsigned int	seq;
+	_Atomic int64_t		temp;		/* millidegrees */
+	_Atomic int64_t		slope;		/* millidegrees per second */
+	_Atomic int		hot;
 };
+static struct sensor *sensors;
+static int      nsensors;
+#endif
 
 int             ncpus = 0;
 struct domain  *domain;
 int             ndomains;
+static int      topochanged;	/* the counters don't match ncpus anymore */
+
+#if defined(__DragonFly__) || defined(__linux__)
+static struct pidfh *pdf;
+#endif
+
+/* bookkeeping per domain that governors don't need to see */
+struct domstat {
+	u_int64_t      *residency;		/* us spent at each freqtab entry */
+	u_int64_t      *transitions;		/* [from * nfreqs + to] */
+	u_int64_t	overheat;		/* us spent throttled by overheating */
+	u_int64_t	loadhist[LOAD_BUCKETS];	/* load at decision time */
+	u_int64_t	loadsum;
+	u_int64_t	decisions;
+	u_int64_t	decidens;		/* ns spent deciding and switching */
+	int		thermidx;		/* thermal cap, index into freqtab */
+	useconds_t	thermtime;		/* since the cap could last be raised */
+	int		sensed;			/* a sensor watches this domain */
+	int		hot;			/* throttled to minidx, -B 0 only */
+	double		degrees;
+	int		written;		/* last curfreq set, -1 if unknown */
+	int		leaseidx;		/* floor from the leases, 0 if none */
+#if !defined(__OpenBSD__) && !defined(__linux__)
+	int		setmib[CTL_MAXNAME];	/* setctl, resolved on first use */
+	size_t		setmiblen;
+#endif
+};
+static struct domstat *domstat;
+
+/* control socket */
+struct client {
+	int		fd;
+	size_t		len;
+	char		buf[CTL_LINEMAX];
+};
+static int      ctlfd = -1;
+static struct client clients[CTL_MAXCLIENTS];
+
+/* a minimum frequency held by a control socket client */
+struct lease {
+	int		id;		/* 0 if the slot is free */
+	struct client  *client;
+	int		domain;		/* -1 for all of them */
+	int		mhz;		/* INT_MAX for the highest frequency */
+	struct timespec	expires;	/* tv_sec 0 if it doesn't */
+};
+static struct lease leases[LEASE_MAX];
+static int      leaseid;
+static volatile sig_atomic_t wakeup;	/* cut the current sleep short */
+static volatile sig_atomic_t dumpevents;	/* SIGHUP or SIGINFO */
+
+/* how late the main loop wakes up after its deadline */
+static u_int64_t jitterhist[JITTER_BUCKETS];
+static u_int64_t jittersum;		/* us */
+static u_int64_t overruns;		/* polls that missed their deadline */
+
+static struct estd_status *status;	/* -Q, mapped */
+
+/*
+ * what estd costs itself: time spent working per poll, wakeups, and the
+ * sysctl/sysfs calls made for each purpose. The sensor thread counts its
+ * own, hence atomic. win* is what the last summary saw.
+ */
+enum {
+	CALL_COUNTERS = 0,
+	CALL_FREQ,
+	CALL_SENSOR,
+	CALL_TOPOLOGY,
+	CALLS
+};
+static const char *callname[CALLS] = { "counters", "frequency", "sensor", "topology" };
+static struct {
+	u_int64_t	polls;
+	u_int64_t	worksum;	/* us */
+	u_int64_t	workmax;	/* us, since the last summary */
+	u_int64_t	wakeups;	/* main loop */
+	u_int64_t	calls[CALLS];
+	u_int64_t	winpolls;
+	u_int64_t	winwork;
+	u_int64_t	winwakeups;
+	u_int64_t	winsensorwakeups;
+	u_int64_t	wincalls[CALLS];
+	u_int64_t	wincpu;		/* us, user + system */
+	char		summary[512];
+} ovh;
+static _Atomic u_int64_t sensorwakeups;
+static _Atomic u_int64_t sensorcalls;
+
+/* mock backend: the simulated clock */
+static u_int64_t mocknow;		/* us */
+
+/* writes made, and skipped because the knob already had that value */
+static u_int64_t freqwrites;
+static u_int64_t freqskipped;
+static u_int64_t clockmodwrites;
+static u_int64_t clockmodskipped;
+static int      clockmod_cur = -1;
+
+static FILE    *tracefh;
+static u_int64_t *tracelast;
+static int      tracencpus;
 
+/*
+ * cpu time counters of the current and the previous poll, sized from ncpus
+ * at startup; cp_save() swaps them instead of copying
+ */
 #if defined(__DragonFly__)
- static struct kinfo_cputime *cp_time;
- static struct kinfo_cputime *cp_old;
- size_t cp_time_len;
+ typedef struct kinfo_cputime cptime_t;
 #else
+ typedef u_int64_t cptime_t[CPUSTATES];
+#endif
+static cptime_t *cp_time;
+static cptime_t *cp_old;
+static size_t   cp_time_len;
+
+#if !defined(__DragonFly__)
 # if defined(__OpenBSD__)
  static int cpumib[3] = {CTL_KERN, KERN_CPTIME2, 0};
+# elif defined(__linux__)
+ static int onlinefd = -1;
+ static char linux_online[SYSCTLBUF];	/* last seen cpu/online */
+ static int procstatfd = -1;
+ static char *procstatbuf;
+ static size_t procstatlen;
 # else
  static int cpumib[2] = {CTL_KERN, KERN_CP_TIME};
 # endif
- static u_int64_t cp_time[MAX_CPUS][CPUSTATES];
- static u_int64_t cp_old[MAX_CPUS][CPUSTATES];
- static u_int64_t cp_diff[MAX_CPUS][CPUSTATES];
- static const size_t cp_time_max_size = sizeof(cp_time[0]) * MAX_CPUS;
 #endif
 
 static char	*techdesc[TECH_MAX + 1] = {"Unknown",
@@ -145,9 +363,11 @@ static char	*techdesc[TECH_MAX + 1] = {"Unknown",
 				"Intrepid",
 				"Loongson",
 				"Rockchip",
-				"OpenBSD"
+				"OpenBSD",
+				"Linux cpufreq",
 				"Generic"
 				};
+#if !defined(__OpenBSD__) && !defined(__linux__)
 static char	*freqctl[TECH_MAX + 1] = {	"",	
 				"machdep.est.frequency.available",
 				"machdep.powernow.frequency.available",
@@ -156,6 +376,7 @@ static char	*freqctl[TECH_MAX + 1] = {	"",
 				"machdep.loongson.frequency.available",
 				"machdep.cpu.frequency.available",
 				"",
+				"",
 				"machdep.frequency.available"
 				};
 static char	*setctl[TECH_MAX + 1] = {"",	
@@ -166,13 +387,17 @@ static char	*setctl[TECH_MAX + 1] = {"",
 				"machdep.loongson.frequency.target",
 				"machdep.cpu.frequency.target",
 				"hw.setperf",
+				"",
 				"machdep.frequency.current"
 				};
+#endif
 
 void
 usage()
 {
-	printf("usage: estd [-d] [-o] [-n] [-A] [-C] [-E] [-I] [-L] [-R] [-P] [-G] [-a] [-s] [-b] [-p poll interval in us] [-g grace period] [-l low watermark percentage] [-h high watermark percentage] [-m minimum MHz] [-M maximum MHz]\n");
+	printf("usage: estd [-d] [-o] [-n] [-A] [-C] [-E] [-I] [-L] [-R] [-P] [-G] [-a] [-s] [-b] [-S governor] [-p poll interval in us] [-i maximum poll interval in us] [-g grace period] [-l low watermark percentage] [-h high watermark percentage] [-u target utilization percentage] [-K kp,ki,kd] [-e load estimators] [-m minimum MHz] [-M maximum MHz] [-w trace file] [-k control socket] [-F metrics file] [-Q status page] [-q] [-j event dump] [-D sysfs root]\n");
+	printf("       estd -r trace file [-a] [-s] [-b] [-S governor] [-g grace period] [-l low watermark percentage] [-h high watermark percentage] [-u target utilization percentage] [-K kp,ki,kd] [-e load estimators] [-m minimum MHz] [-M maximum MHz] [-F metrics file] [-j event dump]\n");
+	printf("       estd -N scenario file [-a] [-s] [-b] [-S governor] [-p poll interval in us] [-i maximum poll interval in us] [-g grace period] [-l low watermark percentage] [-h high watermark percentage] [-u target utilization percentage] [-K kp,ki,kd] [-e load estimators] [-m minimum MHz] [-M maximum MHz] [-F metrics file] [-j event dump]\n");
 	printf("       estd -v\n");
 	printf("       estd -f\n");
 	exit(1);
@@ -199,6 +424,28 @@ ecalloc(size_t number, size_t size) {
 	return ret;
 }
 
+/* need this callback for sorting the frequency-list */
+int
+freqcmp(const void *x, const void *y)
+{
+	return *((int *) x) - *((int *) y);
+}
+
+/* parse a blank separated list of numbers into a new table, returns its length */
+int
+parse_freqs(const char *list, int **tab)
+{
+	char *ep;
+	int n = 0, v;
+
+	*tab = ecalloc(strlen(list) / 2 + 1, sizeof(int));
+	while ((v = strtol(list, &ep, 10)) != 0) {
+		(*tab)[n++] = v;
+		list = ep;
+	}
+	return n;
+}
+
 #if defined(__DragonFly__) || defined(__NetBSD__)
 int
 acpi_init_domain(int d)
@@ -255,17 +502,299 @@ acpi_init()
 }
 #endif /* defined(__DragonFly__) || defined(__NetBSD__) */
 
+#if defined(__linux__)
+/* read a small sysfs attribute, only used during setup */
+int
+linux_read(const char *path, char *buf, size_t len)
+{
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if (n < 0)
+		return -1;
+	buf[n] = '\0';
+	return 0;
+}
+
+int
+linux_write(const char *path, const char *buf)
+{
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_WRONLY)) < 0)
+		return -1;
+	n = write(fd, buf, strlen(buf));
+	close(fd);
+	return n == (ssize_t)strlen(buf) ? 0 : -1;
+}
+
+/* parse a cpulist like "0-3,8" or a plain list like "0 1 2 3" */
+int
+linux_parse_cpus(const char *list, int *cpus, int max)
+{
+	const char *p = list;
+	char *ep;
+	int n = 0, lo, hi;
+
+	while (*p != '\0' && *p != '\n') {
+		if (*p == ',' || *p == ' ') {
+			p++;
+			continue;
+		}
+		lo = hi = strtol(p, &ep, 10);
+		if (ep == p)
+			break;
+		p = ep;
+		if (*p == '-') {
+			p++;
+			hi = strtol(p, &ep, 10);
+			p = ep;
+		}
+		for (; lo <= hi && n < max; lo++)
+			if (lo >= 0 && lo < ncpus)
+				cpus[n++] = lo;
+	}
+
+	return n;
+}
+
+/*
+ * one domain per cpufreq policy, keyed by the first cpu that has it. The
+ * domain is built aside and only added when its frequencies could be read.
+ */
+int
+linux_init_domain(int d, int cpu)
+{
+	char path[MAXPATHLEN];
+	char buf[SYSCTLBUF * 4];
+	struct domain dom;
+	int *khz = NULL;
+	int i, n, lo, hi, step;
+
+	snprintf(path, sizeof(path),
+	    "%s/devices/system/cpu/cpu%d/cpufreq/affected_cpus", sysfsroot, cpu);
+	if (linux_read(path, buf, sizeof(buf)) < 0)
+		return 1;
+
+	memset(&dom, 0, sizeof(dom));
+	dom.setfd = -1;
+
+	dom.cpus = ecalloc(ncpus, sizeof(int));
+	dom.ncpus = linux_parse_cpus(buf, dom.cpus, ncpus);
+
+	asprintf(&dom.freqctl,
+	    "%s/devices/system/cpu/cpu%d/cpufreq/scaling_available_frequencies", sysfsroot, cpu);
+	asprintf(&dom.setctl,
+	    "%s/devices/system/cpu/cpu%d/cpufreq/scaling_setspeed", sysfsroot, cpu);
+	asprintf(&dom.govctl,
+	    "%s/devices/system/cpu/cpu%d/cpufreq/scaling_governor", sysfsroot, cpu);
+	if (dom.setctl == NULL || dom.freqctl == NULL || dom.govctl == NULL) {
+		fprintf(stderr, "estd: asprintf failed\n");
+		exit(1);
+	}
+
+	/* get supported frequencies (in kHz)... */
+	n = 0;
+	if (linux_read(dom.freqctl, buf, sizeof(buf)) == 0)
+		n = parse_freqs(buf, &khz);
+	if (n == 0) {
+		/* ...or make up a table for drivers that don't export one */
+		snprintf(path, sizeof(path),
+		    "%s/devices/system/cpu/cpu%d/cpufreq/cpuinfo_min_freq", sysfsroot, cpu);
+		if (linux_read(path, buf, sizeof(buf)) < 0)
+			goto fail;
+		lo = atoi(buf);
+		snprintf(path, sizeof(path),
+		    "%s/devices/system/cpu/cpu%d/cpufreq/cpuinfo_max_freq", sysfsroot, cpu);
+		if (linux_read(path, buf, sizeof(buf)) < 0)
+			goto fail;
+		hi = atoi(buf);
+		step = MAX(100000, (hi - lo) / (LINUX_FREQSTEPS - 1));
+		free(khz);
+		khz = ecalloc(LINUX_FREQSTEPS, sizeof(int));
+		for (i = lo; i < hi && n < LINUX_FREQSTEPS - 1; i += step)
+			khz[n++] = i;
+		khz[n++] = hi;
+	}
+
+	/* ...sort them in ascending order, drop duplicates */
+	qsort(khz, n, sizeof(khz[0]), &freqcmp);
+	dom.freqtab = ecalloc(n, sizeof(int));
+	dom.freqtab2perf = ecalloc(n, sizeof(int));
+	for (i = 0; i < n; i++) {
+		if (i > 0 && khz[i] == khz[i - 1])
+			continue;
+		dom.freqtab[dom.nfreqs] = khz[i] / 1000;
+		dom.freqtab2perf[dom.nfreqs] = khz[i];
+		dom.nfreqs++;
+	}
+	free(khz);
+
+	ndomains = d + 1;
+	domain = realloc(domain, ndomains * sizeof(struct domain));
+	if (domain == NULL) {
+		fprintf(stderr, "estd: realloc failed (errno %d)\n", errno);
+		exit(1);
+	}
+	domain[d] = dom;
+
+	if ((!daemonize) && (verbose))
+		for (i = 0; i < domain[d].ncpus; i++)
+			printf("estd: domain %d: member %d\n", d, domain[d].cpus[i]);
+
+	return 0;
+
+ fail:
+	free(khz);
+	free(dom.cpus);
+	free(dom.freqctl);
+	free(dom.setctl);
+	free(dom.govctl);
+	return 1;
+}
+
+int
+linux_init()
+{
+	char path[MAXPATHLEN];
+	int *online, nonline;
+	int cpu, d = 0, i, j, k, seen;
+	ssize_t len;
+
+	/* only online cpus belong to a domain */
+	online = ecalloc(ncpus, sizeof(int));
+	if (onlinefd < 0) {
+		snprintf(path, sizeof(path), "%s/devices/system/cpu/online", sysfsroot);
+		onlinefd = open(path, O_RDONLY);
+	}
+	if ((onlinefd >= 0) &&
+	    ((len = pread(onlinefd, linux_online, sizeof(linux_online) - 1, 0)) > 0)) {
+		linux_online[len] = '\0';
+		nonline = linux_parse_cpus(linux_online, online, ncpus);
+	} else {
+		for (nonline = 0; nonline < ncpus; nonline++)
+			online[nonline] = nonline;
+	}
+
+	for (k = 0; k < nonline; k++) {
+		cpu = online[k];
+		seen = 0;
+		for (i = 0; i < d && !seen; i++)
+			for (j = 0; j < domain[i].ncpus; j++)
+				if (domain[i].cpus[j] == cpu)
+					seen = 1;
+		if (!seen && linux_init_domain(d, cpu) == 0)
+			d++;
+	}
+	free(online);
+	if (d == 0)
+		return 1;
+
+	if ((procstatfd < 0) &&
+	    ((procstatfd = open(_PATH_PROCSTAT, O_RDONLY)) < 0)) {
+		fprintf(stderr, "estd: Cannot open %s\n", _PATH_PROCSTAT);
+		exit(1);
+	}
+	/* room for the aggregate line and one line per cpu, the rest is never read */
+	free(procstatbuf);
+	procstatlen = (ncpus + 1) * 256;
+	procstatbuf = ecalloc(procstatlen, 1);
+
+	return 0;
+}
+
+/* switch a policy to the userspace governor and keep scaling_setspeed open */
+void
+linux_takeover_domain(struct domain *dom)
+{
+	char *p;
+
+	if (linux_read(dom->govctl, dom->oldgov, sizeof(dom->oldgov)) == 0) {
+		if ((p = strchr(dom->oldgov, '\n')) != NULL)
+			*p = '\0';
+	}
+	if (linux_write(dom->govctl, LINUX_GOVERNOR) < 0 ||
+	    (dom->setfd = open(dom->setctl, O_WRONLY)) < 0) {
+		fprintf(stderr, "estd: Cannot select the " LINUX_GOVERNOR " governor (maybe you aren't root?)\n");
+		exit(1);
+	}
+}
+
+void
+linux_takeover()
+{
+	int d;
+
+	for (d = 0; d < ndomains; d++)
+		linux_takeover_domain(&domain[d]);
+}
+
+/* hand a policy back to the governor that was active before */
+void
+linux_release_domain(struct domain *dom)
+{
+	if (dom->setfd < 0)
+		return;
+	close(dom->setfd);
+	dom->setfd = -1;
+	if (dom->oldgov[0] != '\0')
+		linux_write(dom->govctl, dom->oldgov);
+}
+
+void
+linux_release()
+{
+	int d;
+
+	for (d = 0; d < ndomains; d++)
+		linux_release_domain(&domain[d]);
+}
+#endif /* defined(__linux__) */
+
+
+/* keep the previous snapshot for computing deltas */
+void
+cp_save(void)
+{
+	cptime_t *tmp = cp_old;
+
+	cp_old = cp_time;
+	cp_time = tmp;
+}
+
+void
+cp_alloc(void)
+{
+	cp_time = ecalloc(ncpus, sizeof(cptime_t));
+	cp_old = ecalloc(ncpus, sizeof(cptime_t));
+	cp_time_len = ncpus * sizeof(cptime_t);
+}
 
 /* returns cpu-usage in percent, mean over the sleep-interval or -1 if an error occured */
 #if defined(__DragonFly__)
 int
 get_cputime()
 {
+	static int mib[CTL_MAXNAME];
+	static size_t miblen;
 	size_t len = cp_time_len;
 
-	memcpy(cp_old, cp_time, cp_time_len);
+	cp_save();
 
-	if (sysctlbyname("kern.cputime", cp_time, &len, NULL, 0) < 0) {
+	if (miblen == 0) {
+		miblen = CTL_MAXNAME;
+		if (sysctlnametomib("kern.cputime", mib, &miblen) < 0) {
+			fprintf(stderr, "estd: Cannot get CPU status\n");
+			exit(1);
+		}
+	}
+	ovh.calls[CALL_COUNTERS]++;
+	if (sysctl(mib, miblen, cp_time, &len, NULL, 0) < 0) {
 		fprintf(stderr, "estd: Cannot get CPU status\n");
 		exit(1);	
 	}
@@ -278,26 +807,20 @@ int
 get_cpuusage(int d)
 {
 	int                  i, cpu, load, max_load = 0;
-	u_int64_t            total_time;
-	struct kinfo_cputime cp_diff;
+	u_int64_t            total_time, idle, nice;
 
 	for (i = 0; i < domain[d].ncpus; i++) {
 		cpu = domain[d].cpus[i];
-		total_time = 0;
 
-		cp_diff.cp_user = cp_time[cpu].cp_user - cp_old[cpu].cp_user;
-		total_time += cp_diff.cp_user;
-		cp_diff.cp_nice = cp_time[cpu].cp_nice - cp_old[cpu].cp_nice;
-		total_time += cp_diff.cp_nice;
-		cp_diff.cp_sys = cp_time[cpu].cp_sys - cp_old[cpu].cp_sys;
-		total_time += cp_diff.cp_sys;
-		cp_diff.cp_intr = cp_time[cpu].cp_intr - cp_old[cpu].cp_intr;
-		total_time += cp_diff.cp_intr;
-		cp_diff.cp_idle = cp_time[cpu].cp_idle - cp_old[cpu].cp_idle;
-		total_time += cp_diff.cp_idle;
+		idle = cp_time[cpu].cp_idle - cp_old[cpu].cp_idle;
+		nice = cp_time[cpu].cp_nice - cp_old[cpu].cp_nice;
+		total_time = idle + nice +
+		    (cp_time[cpu].cp_user - cp_old[cpu].cp_user) +
+		    (cp_time[cpu].cp_sys - cp_old[cpu].cp_sys) +
+		    (cp_time[cpu].cp_intr - cp_old[cpu].cp_intr);
 
 		if (total_time > 0) {
-			load = 100 - ((cp_diff.cp_idle + (cp_diff.cp_nice * nicemod)) * 100) / total_time;
+			load = 100 - ((idle + (nice * nicemod)) * 100) / total_time;
 			if (load > max_load)
 				max_load = load;
 		}
@@ -314,66 +837,140 @@ get_cputime(void)
 	size_t cp_time_size = sizeof(cp_time[0]);
 	int cpu;
 
-	memcpy(cp_old, cp_time, cp_time_max_size);
+	cp_save();
 
 	for (cpu = 0; cpu < ncpus; cpu++) {
 		cpumib[2] = cpu;
+		ovh.calls[CALL_COUNTERS]++;
 		if (sysctl(cpumib, 3, &cp_time[cpu], &cp_time_size, NULL, 0) < 0) {
 			fprintf(stderr, "estd: Cannot get CPU status\n");
 			exit(1);
 		}
 	}
-#else
-	size_t cp_time_size = cp_time_max_size;
+#elif defined(__linux__)
+	ssize_t len;
+	u_int64_t val;
+	char *p;
+	int cpu, field, next = 0;
+
+	cp_save();
 
-	memcpy(cp_old, cp_time, cp_time_max_size);
-	if (sysctl(cpumib, 2, &cp_time, &cp_time_size, NULL, 0) < 0) {
+	ovh.calls[CALL_COUNTERS]++;
+	len = pread(procstatfd, procstatbuf, procstatlen - 1, 0);
+	if (len <= 0) {
 		fprintf(stderr, "estd: Cannot get CPU status\n");
 		exit(1);
 	}
+	procstatbuf[len] = '\0';
+
+	/* skip the aggregate line, then parse "cpuN user nice system idle iowait irq softirq steal ..." */
+	p = procstatbuf;
+	while ((p = strchr(p, '\n')) != NULL && strncmp(++p, "cpu", 3) == 0) {
+		p += 3;
+		for (cpu = 0; *p >= '0' && *p <= '9'; p++)
+			cpu = cpu * 10 + (*p - '0');
+		if (cpu >= ncpus)
+			continue;
+		/* offline cpus are missing, keep their counters still */
+		for (; next < cpu; next++)
+			memcpy(cp_time[next], cp_old[next], sizeof(cp_time[next]));
+		next = cpu + 1;
+		memset(cp_time[cpu], 0, sizeof(cp_time[cpu]));
+		for (field = 0; *p != '\n' && *p != '\0'; field++) {
+			while (*p == ' ')
+				p++;
+			for (val = 0; *p >= '0' && *p <= '9'; p++)
+				val = val * 10 + (*p - '0');
+			switch (field) {
+			case 0:	cp_time[cpu][CP_USER] = val; break;
+			case 1:	cp_time[cpu][CP_NICE] = val; break;
+			case 2:	cp_time[cpu][CP_SYS] = val; break;
+			case 3:	/* idle */
+			case 4:	cp_time[cpu][CP_IDLE] += val; break;	/* iowait */
+			case 5:	/* irq */
+			case 6:	/* softirq */
+			case 7:	cp_time[cpu][CP_INTR] += val; break;	/* steal */
+			}
+		}
+	}
+	for (; next < ncpus; next++)
+		memcpy(cp_time[next], cp_old[next], sizeof(cp_time[next]));
+#else
+	size_t cp_time_size = cp_time_len;
 
-	ncpus = cp_time_size / sizeof cp_time[0];
+	cp_save();
+	ovh.calls[CALL_COUNTERS]++;
+	if (sysctl(cpumib, 2, cp_time, &cp_time_size, NULL, 0) < 0) {
+		if (errno != ENOMEM) {
+			fprintf(stderr, "estd: Cannot get CPU status\n");
+			exit(1);
+		}
+		/* more cpus than we have room for */
+		cp_time_size = 0;
+		topochanged = 1;
+	}
+	/* cpus the kernel didn't report this time stand still */
+	if (cp_time_size < cp_time_len) {
+		memcpy((char *)cp_time + cp_time_size, (char *)cp_old + cp_time_size,
+		    cp_time_len - cp_time_size);
+		topochanged = 1;
+	}
 #endif
 	return 0;
 }
 
+/* get maximum load of a cpu in domain d */
 int
 get_cpuusage(int d)
 {
-	u_int64_t	max_total_time = 0;
-	int		cpu_of_max = 0;
-	int		cpu;
-	int             i;
+	u_int64_t	total_time;
+	const u_int64_t *now, *old;
+	int		i, j, cpu, load, max_load = -1;
 
-	for (cpu = 0; cpu < ncpus; cpu++) {
-		u_int64_t total_time = 0;
+	for (j = 0; j < domain[d].ncpus; j++) {
+		cpu = domain[d].cpus[j];
+		/* NetBSD may report fewer cpus than we started with */
+		if (cpu >= ncpus)
+			continue;
 
-		for (i = 0; i < CPUSTATES; i++) {
-			cp_diff[cpu][i] = cp_time[cpu][i] - cp_old[cpu][i];
-			if (i != CP_IDLE)
-				total_time += cp_diff[cpu][i];
-		}
-		if (total_time > max_total_time) {
-			max_total_time = total_time;
-			cpu_of_max = cpu;
+		now = cp_time[cpu];
+		old = cp_old[cpu];
+		total_time = 0;
+		for (i = 0; i < CPUSTATES; i++)
+			total_time += now[i] - old[i];
+		if (total_time > 0) {
+			load = 100 - (((now[CP_IDLE] - old[CP_IDLE]) +
+			    ((now[CP_NICE] - old[CP_NICE]) * nicemod)) * 100) / total_time;
+			if (load > max_load)
+				max_load = load;
 		}
 	}
 
-	max_total_time += cp_diff[cpu_of_max][CP_IDLE];
-
-	/* we've probably been interrupted by a signal... */
-	if (max_total_time < 1) return -1; 
-
-	return (100 - ((cp_diff[cpu_of_max][CP_IDLE] +
-			(cp_diff[cpu_of_max][CP_NICE] * nicemod)) * 100) /
-				max_total_time);
+	/* -1: we've probably been interrupted by a signal... */
+	return max_load;
 }
 #endif
 
-/* sets the cpu frequency */
+/* sets the cpu frequency, unless it is set already */
 void
 set_freq(int d)
 {
+	if (domain[d].curfreq == domstat[d].written) {
+		freqskipped++;
+		return;
+	}
+	domstat[d].written = domain[d].curfreq;
+	freqwrites++;
+
+	if (mockfile != NULL) {
+		if ((!daemonize) && (verbose))
+			printf("mock: %.3f s domain %d %i MHz\n", mocknow / 1000000.0, d,
+			    domain[d].freqtab[domain[d].curfreq]);
+		return;
+	}
+	if (replayfile != NULL)
+		return;
+	ovh.calls[CALL_FREQ]++;
 #ifdef __OpenBSD__
 	int hw_setperf_mib[] = { CTL_HW, HW_SETPERF };
 	int freq = domain[d].freqtab[domain[d].curfreq];
@@ -386,12 +983,34 @@ set_freq(int d)
 		fprintf(stderr, "estd: Cannot set CPU frequency (maybe you aren't root?)\n");
 		exit(1);
 	}
+#elif defined(__linux__)
+	int freq = domain[d].freqtab[domain[d].curfreq];
+	char buf[16];
+	int len;
+
+	if ((!daemonize) && (verbose))
+		printf("%i MHz\n", freq);
+
+	len = snprintf(buf, sizeof(buf), "%d\n", domain[d].freqtab2perf[domain[d].curfreq]);
+	if (pwrite(domain[d].setfd, buf, len, 0) != len) {
+		fprintf(stderr, "estd: Cannot set CPU frequency (maybe you aren't root?)\n");
+		exit(1);
+	}
 #else
 	int freq = domain[d].freqtab[domain[d].curfreq];
 
 	if ((!daemonize) && (verbose))
 		printf("%i MHz\n", freq);
-	if (sysctlbyname(domain[d].setctl, NULL, NULL, &freq, sizeof(freq)) < 0) {
+	if (domstat[d].setmiblen == 0) {
+		domstat[d].setmiblen = CTL_MAXNAME;
+		if (sysctlnametomib(domain[d].setctl, domstat[d].setmib,
+		    &domstat[d].setmiblen) < 0) {
+			fprintf(stderr, "estd: Cannot find %s\n", domain[d].setctl);
+			exit(1);
+		}
+	}
+	if (sysctl(domstat[d].setmib, domstat[d].setmiblen, NULL, NULL, &freq,
+	    sizeof(freq)) < 0) {
 		fprintf(stderr, "estd: Cannot set CPU frequency (maybe you aren't root?)\n");
 		exit(1);
 	}
@@ -402,76 +1021,2757 @@ void
 set_clockmod(int level)
 {
 #ifdef __NetBSD__
+	static int mib[CTL_MAXNAME];
+	static size_t miblen;
+#endif
+
 	if (!use_clockmod || level == -1)
 		return;
+	if (level == clockmod_cur) {
+		clockmodskipped++;
+		return;
+	}
+	clockmod_cur = level;
+	clockmodwrites++;
+	if ((mockfile != NULL) || (replayfile != NULL))
+		return;
 
+#ifdef __NetBSD__
 	if ((!daemonize) && (verbose))
 		printf("clockmod level: %i\n", level);
-	if (sysctlbyname("machdep.clockmod.target", NULL, NULL, &level,
-	    sizeof(level)) < 0) {
+	if (miblen == 0) {
+		miblen = CTL_MAXNAME;
+		if (sysctlnametomib("machdep.clockmod.target", mib, &miblen) < 0) {
+			fprintf(stderr, "estd: Cannot set clockmod level\n");
+			exit(1);
+		}
+	}
+	ovh.calls[CALL_FREQ]++;
+	if (sysctl(mib, miblen, NULL, NULL, &level, sizeof(level)) < 0) {
 		fprintf(stderr, "estd: Cannot set clockmod level (maybe you aren't root?)\n");
 		exit(1);
 	}
 #endif
 }
 
-/* need this callback for sorting the frequency-list */
-int
-freqcmp(const void *x, const void *y)
+/* apply -m/-M to the frequency table of domain d, returns NULL or why it can't */
+const char *
+domain_limits(int d, int mhzmin, int mhzmax, int apply)
 {
-	return *((int *) x) - *((int *) y);
+	int minidx = 0, maxidx = domain[d].nfreqs - 1;
+
+	/* some sanity checks */
+	while ((minidx < domain[d].nfreqs) && (domain[d].freqtab[minidx] < mhzmin))
+		minidx++;
+	if (minidx >= domain[d].nfreqs)
+		return "Minimum Frequency is too high";
+	while ((maxidx > -1) && (domain[d].freqtab[maxidx] > mhzmax))
+		maxidx--;
+	if (maxidx < 0)
+		return "Maximum Frequency is too low";
+	if (domain[d].freqtab[minidx] > domain[d].freqtab[maxidx])
+		return "No supported frequency within given range found";
+
+	if (apply) {
+		domain[d].minidx = minidx;
+		domain[d].maxidx = maxidx;
+	}
+	return NULL;
 }
 
-/* clean up the pidfile and clockmod on exit */
-void
-sighandler(int sig)
+int
+valid_watermarks(int h, int l)
 {
-	set_clockmod(clockmod_max);
-#ifdef __OpenBSD__
-	{
-		int hw_perfpolicy[] = {CTL_HW, HW_PERFPOLICY};
-		sysctl(hw_perfpolicy, 2, NULL, NULL, "auto", sizeof("auto") - 1);
-	}
-#endif
-	exit(0);
+	return !((h <= l) || (l < 0) || (l > 100) || (h < 0) || (h > 100));
 }
 
-/* switch strategy on SIGUSR{1,2} */
-void
-sigusrhandler(int sig)
+/* the classic strategies: step on the watermarks, differ in step size */
+int
+watermark_decide(struct domain *dom, const struct sample *smp, useconds_t dt, int strat)
 {
-	switch (sig) {
-		case SIGUSR1:
-				if (strategy>BATTERY) strategy--;
-				break;
-		case SIGUSR2:
-				if (strategy<AGGRESSIVE) strategy++;
-				break;
+	/* a burst wins over a slow estimate that is still low */
+	if ((dom->curfreq < dom->maxidx) && (!smp->overheating && (smp->up > high))) {
+		dom->lowtime = 0;
+		if (strat == AGGRESSIVE)
+			return dom->maxidx;
+		return dom->curfreq + 1;
 	}
+
+	/* slow down only when neither estimate asks for more */
+	if ((dom->curfreq > dom->minidx) && (smp->overheating || (MAX(smp->up, smp->down) < low))) {
+		if (dom->lowtime < lowgrace)
+			dom->lowtime += dt;
+
+		if (dom->lowtime >= lowgrace) {
+			if (strat == BATTERY)
+				return dom->minidx;
+			return dom->curfreq - 1;
+		}
+	} else
+		dom->lowtime = 0;
+
+	return dom->curfreq;
 }
 
 int
-main(int argc, char *argv[])
+battery_decide(struct domain *dom, const struct sample *smp, useconds_t dt)
 {
-	int             ch;
-	int             i;
-	char            frequencies[SYSCTLBUF];	/* XXX Ugly */
-	char           *fp;
-	size_t          freqsize = SYSCTLBUF;
-	int	            curstrat = strategy;
-	int             d;
-	FILE           *fexists;
-#if defined(__DragonFly__)
-	struct pidfh *pdf;
-#endif
-	char procbuf[1024];
-	size_t proclen;
+	return watermark_decide(dom, smp, dt, BATTERY);
+}
+
+int
+smooth_decide(struct domain *dom, const struct sample *smp, useconds_t dt)
+{
+	return watermark_decide(dom, smp, dt, SMOOTH);
+}
+
+int
+aggressive_decide(struct domain *dom, const struct sample *smp, useconds_t dt)
+{
+	return watermark_decide(dom, smp, dt, AGGRESSIVE);
+}
+
+/* slowest frequency that runs load percent of the current speed at the target */
+int
+capacity_index(struct domain *dom, int load)
+{
+	int i, need;
+
+	need = load * dom->freqtab[dom->curfreq] / target;
+	for (i = dom->minidx; (i < dom->maxidx) && (dom->freqtab[i] < need); i++)
+		;
+
+	return i;
+}
+
+int
+capacity_decide(struct domain *dom, const struct sample *smp, useconds_t dt)
+{
+	int i;
+
+	if (smp->overheating)
+		i = dom->curfreq - 1;
+	else if (smp->up >= SATURATED_LOAD)
+		i = dom->maxidx;
+	else if ((i = capacity_index(dom, smp->up)) <= dom->curfreq)
+		i = MIN(dom->curfreq, MAX(i, capacity_index(dom, smp->down)));
+
+	if (i < dom->curfreq) {
+		if (dom->lowtime < lowgrace)
+			dom->lowtime += dt;
+		if (dom->lowtime < lowgrace)
+			return dom->curfreq;
+	} else
+		dom->lowtime = 0;
+
+	return i;
+}
+
+/*
+ * pid: hold the load at the target utilization with frequency as the
+ * actuator. The controller output is a position between the minimum and
+ * maximum frequency, rounded to the nearest table entry. A shadow smooth
+ * governor runs on the same load to count the transitions saved; only its
+ * index and grace time are kept, so a rebuilt frequency table can't leave
+ * it pointing at freed memory.
+ */
+struct pidstate {
+	double		integral;
+	double		lasterr;
+	int		smoothidx;
+	useconds_t	smoothlow;
+	int		transitions;
+	int		smoothtransitions;
+};
+
+double
+pid_position(struct domain *dom, int idx)
+{
+	int lo = dom->freqtab[dom->minidx], hi = dom->freqtab[dom->maxidx];
+
+	if (hi == lo)
+		return 0.0;
+	return (double)(dom->freqtab[idx] - lo) / (hi - lo);
+}
+
+int
+pid_init(struct domain *dom)
+{
+	struct pidstate *ps;
+
+	ps = ecalloc(1, sizeof(struct pidstate));
+	ps->integral = pid_position(dom, dom->curfreq);
+	ps->smoothidx = dom->curfreq;
+	dom->govdata = ps;
+
+	return 0;
+}
+
+int
+pid_decide(struct domain *dom, const struct sample *smp, useconds_t dt)
+{
+	struct pidstate *ps = dom->govdata;
+	struct sample    ssmp = *smp;
+	struct domain    sd;
+	double           err, deriv, out, secs = dt / 1000000.0;
+	int              i, best, mhz, next;
+
+	/* smooth would see a different load at its own speed */
+	memset(&sd, 0, sizeof(sd));
+	sd.freqtab = dom->freqtab;
+	sd.nfreqs = dom->nfreqs;
+	sd.minidx = dom->minidx;
+	sd.maxidx = dom->maxidx;
+	sd.curfreq = MAX(dom->minidx, MIN(dom->maxidx, ps->smoothidx));
+	sd.lowtime = ps->smoothlow;
+	ssmp.load = MIN(100, smp->load * dom->freqtab[dom->curfreq] /
+	    sd.freqtab[sd.curfreq]);
+	ssmp.up = MIN(100, smp->up * dom->freqtab[dom->curfreq] /
+	    sd.freqtab[sd.curfreq]);
+	ssmp.down = MIN(100, smp->down * dom->freqtab[dom->curfreq] /
+	    sd.freqtab[sd.curfreq]);
+	/* under the same limits and thermal cap as the real decision */
+	next = MAX(dom->minidx, MIN(MIN(dom->maxidx, domstat[dom - domain].thermidx),
+	    smooth_decide(&sd, &ssmp, dt)));
+	if (next != sd.curfreq)
+		ps->smoothtransitions++;
+	ps->smoothidx = next;
+	ps->smoothlow = sd.lowtime;
+
+	if (smp->overheating) {
+		best = MAX(dom->minidx, dom->curfreq - 1);
+		ps->integral = MIN(ps->integral, pid_position(dom, best));
+		ps->lasterr = 0.0;
+	} else {
+		err = (smp->load - target) / 100.0;
+		deriv = (secs > 0.0) ? (err - ps->lasterr) / secs : 0.0;
+		ps->lasterr = err;
+
+		out = pid_kp * err + ps->integral + pid_ki * err * secs + pid_kd * deriv;
+		/* anti-windup: stop integrating while the output is pinned */
+		if (!((out >= 1.0 && err > 0.0) || (out <= 0.0 && err < 0.0)))
+			ps->integral += pid_ki * err * secs;
+		ps->integral = MAX(0.0, MIN(1.0, ps->integral));
+		out = MAX(0.0, MIN(1.0, out));
+
+		mhz = dom->freqtab[dom->minidx] +
+		    out * (dom->freqtab[dom->maxidx] - dom->freqtab[dom->minidx]);
+		best = dom->minidx;
+		for (i = dom->minidx; i <= dom->maxidx; i++)
+			if (abs(dom->freqtab[i] - mhz) < abs(dom->freqtab[best] - mhz))
+				best = i;
+	}
+
+	return best;
+}
+
+void
+pid_teardown(struct domain *dom)
+{
+	struct pidstate *ps = dom->govdata;
+
+	if (!daemonize)
+		printf("Domain %d: pid made %d transitions, smooth would have made %d (%d avoided)\n",
+		    (int)(dom - domain), ps->transitions, ps->smoothtransitions,
+		    ps->smoothtransitions - ps->transitions);
+	free(ps);
+	dom->govdata = NULL;
+}
+
+struct governor gov_battery = { ESTD_GOVERNOR_VERSION, "battery", NULL, battery_decide, NULL };
+struct governor gov_smooth = { ESTD_GOVERNOR_VERSION, "smooth", NULL, smooth_decide, NULL };
+struct governor gov_aggressive = { ESTD_GOVERNOR_VERSION, "aggressive", NULL, aggressive_decide, NULL };
+struct governor gov_capacity = { ESTD_GOVERNOR_VERSION, "capacity", NULL, capacity_decide, NULL };
+struct governor gov_pid = { ESTD_GOVERNOR_VERSION, "pid", pid_init, pid_decide, pid_teardown };
+
+/* BATTERY, SMOOTH and AGGRESSIVE must stay first, SIGUSR{1,2} step through them */
+struct governor *governors[MAX_GOVERNORS] = { &gov_battery, &gov_smooth, &gov_aggressive,
+				&gov_capacity, &gov_pid };
+int             ngovernors = 5;
+int             activegov = -1;
+
+/* look up a governor by name, or load it if the name is a path */
+int
+governor_find(const char *name)
+{
+	struct governor *gov;
+	void *dl;
+	int i;
+
+	for (i = 0; i < ngovernors; i++)
+		if (strcmp(governors[i]->name, name) == 0)
+			return i;
+
+	if (strchr(name, '/') == NULL) {
+		fprintf(stderr, "estd: Unknown governor %s\n", name);
+		exit(1);
+	}
+	if ((dl = dlopen(name, RTLD_NOW)) == NULL) {
+		fprintf(stderr, "estd: Cannot load governor: %s\n", dlerror());
+		exit(1);
+	}
+	if ((gov = dlsym(dl, "estd_governor")) == NULL) {
+		fprintf(stderr, "estd: %s does not export estd_governor\n", name);
+		exit(1);
+	}
+	if ((gov->version != ESTD_GOVERNOR_VERSION) || (gov->decide == NULL)) {
+		fprintf(stderr, "estd: %s was built for a different estd\n", name);
+		exit(1);
+	}
+	if (ngovernors >= MAX_GOVERNORS) {
+		fprintf(stderr, "estd: Too many governors\n");
+		exit(1);
+	}
+	governors[ngovernors] = gov;
+	return ngovernors++;
+}
+
+/* remember curcpu in the load history of domain d */
+void
+load_push(struct domain *dom, useconds_t dt)
+{
+	double alpha;
+
+	dom->loadhist[dom->loadpos] = dom->curcpu;
+	dom->loadpos = (dom->loadpos + 1) % LOAD_HIST;
+	if (dom->nloads < LOAD_HIST)
+		dom->nloads++;
+
+	/* weight by elapsed time, so the half-life holds with adaptive polling */
+	if (dom->nloads == 1)
+		dom->ewma = dom->curcpu;
+	else {
+		alpha = 1.0 - exp2(-(double)dt / halflife);
+		dom->ewma += alpha * (dom->curcpu - dom->ewma);
+	}
+}
+
+int
+load_estimate(struct domain *dom, int est)
+{
+	int win[LOAD_HIST];
+	int i, j, n, v;
+
+	n = MIN(dom->nloads, loadwindow);
+	for (i = 0; i < n; i++)
+		win[i] = dom->loadhist[(dom->loadpos - 1 - i + LOAD_HIST) % LOAD_HIST];
+
+	switch (est) {
+	case EST_EWMA:
+		return (int)(dom->ewma + 0.5);
+	case EST_MAX:
+		for (i = 1; i < n; i++)
+			win[0] = MAX(win[0], win[i]);
+		return win[0];
+	case EST_P90:
+		for (i = 1; i < n; i++) {
+			v = win[i];
+			for (j = i; (j > 0) && (win[j - 1] > v); j--)
+				win[j] = win[j - 1];
+			win[j] = v;
+		}
+		return win[(n * 9 + 9) / 10 - 1];
+	default:
+		return dom->curcpu;
+	}
+}
+
+/*
+ * Event ring: every frequency change and its reason is kept in a fixed ring
+ * of binary records, so there is some history even when running as a daemon.
+ * Only the main loop writes, and it advances evclock at the start of each
+ * poll, before the thermal cap and the decisions are recorded. A slot's seq
+ * is zero while it is rewritten, which lets event_dump() run from a signal
+ * handler without locks.
+ */
+#define EVENT_RING 4096		/* records */
+
+static struct estd_event events[EVENT_RING];
+static u_int32_t evhead;	/* records written so far */
+static u_int64_t evclock;	/* sum of the elapsed time of all polls */
+
+void
+event_record(int d, int reason, int oldidx, int newidx)
+{
+	struct estd_event *ev = &events[evhead % EVENT_RING];
+	int freqs = (d >= 0) && (reason != ESTD_EVENT_TOPOLOGY);
+
+	ev->seq = 0;
+	atomic_thread_fence(memory_order_release);
+	ev->time = evclock;
+	ev->domain = d;
+	ev->reason = reason;
+	ev->load = (d >= 0) ? domain[d].curcpu : -1;
+	ev->oldidx = oldidx;
+	ev->newidx = newidx;
+	ev->oldmhz = freqs ? domain[d].freqtab[oldidx] : 0;
+	ev->newmhz = freqs ? domain[d].freqtab[newidx] : 0;
+	atomic_thread_fence(memory_order_release);
+	ev->seq = ++evhead;
+}
+
+/*
+ * Write the ring to path, oldest first. Only uses open and write, so the
+ * signal handlers may call it; slots rewritten meanwhile are left out.
+ */
+int
+event_dump(const char *path)
+{
+	struct estd_events_header hdr;
+	struct estd_event buf[64];
+	u_int32_t head = evhead, i, seq;
+	int fd, n = 0, ret = 0;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		return -1;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = ESTD_EVENTS_MAGIC;
+	hdr.version = ESTD_EVENTS_VERSION;
+	hdr.size = sizeof(hdr);
+	hdr.recsize = sizeof(struct estd_event);
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		ret = -1;
+
+	for (i = head - MIN(head, EVENT_RING); (ret == 0) && (i != head); i++) {
+		seq = events[i % EVENT_RING].seq;
+		atomic_thread_fence(memory_order_acquire);
+		buf[n] = events[i % EVENT_RING];
+		atomic_thread_fence(memory_order_acquire);
+		if ((seq != i + 1) || (events[i % EVENT_RING].seq != seq))
+			continue;
+		if (++n == 64) {
+			if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+				ret = -1;
+			n = 0;
+		}
+	}
+	if ((ret == 0) && (n > 0) &&
+	    (write(fd, buf, n * sizeof(buf[0])) != (ssize_t)(n * sizeof(buf[0]))))
+		ret = -1;
+	close(fd);
+	return ret;
+}
+
+/* one round of frequency decisions, shared by the main loop and trace replay */
+void
+update_domains(int overheating, useconds_t elapsed, int *idle, int *moving)
+{
+	struct governor *gov;
+	struct sample   smp;
+	struct timespec ts_start, ts_end;
+	int             d, prevcpu, want, newfreq, hot, reason, up = 0, down = 0;
+	struct pidstate *ps;
+
+	/* strategy can change anytime (SIGUSR) */ 
+	if (strategy != activegov) {
+		event_record(-1, ESTD_EVENT_STRATEGY, activegov, strategy);
+		for (d = 0; (activegov != -1) && (d < ndomains); d++)
+			if (governors[activegov]->teardown != NULL)
+				governors[activegov]->teardown(&domain[d]);
+		activegov = strategy;
+		for (d = 0; d < ndomains; d++) {
+			if ((governors[activegov]->init != NULL) &&
+			    (governors[activegov]->init(&domain[d]) != 0)) {
+				fprintf(stderr, "estd: Cannot initialize governor %s\n",
+				    governors[activegov]->name);
+				exit(1);
+			}
+		}
+		if ((!daemonize) && (verbose))
+			printf("estd: governor %s\n", governors[activegov]->name);
+	}
+	gov = governors[activegov];
+
+	*idle = 1;
+	*moving = 0;
+	for (d = 0; d < ndomains; d++) {
+		prevcpu = domain[d].curcpu;
+		domain[d].curcpu = get_cpuusage(d);
+		if ((!daemonize) && (verbose))
+			printf("estd: load(%d) %d\n", d, domain[d].curcpu);
+		if (domain[d].curcpu != -1) {
+			hot = overheating || domstat[d].hot;
+#ifdef OVERHEAT_HACK
+			if (hot) {
+				if ((!daemonize) && (verbose))
+					printf("estd: overheat(%d)\n", d);
+			}
+#endif
+			clock_gettime(CLOCK_MONOTONIC, &ts_start);
+			domstat[d].residency[domain[d].curfreq] += elapsed;
+			if (hot || (domstat[d].thermidx < domain[d].maxidx))
+				domstat[d].overheat += elapsed;
+			domstat[d].loadhist[MAX(0, MIN((domain[d].curcpu - 1) / (100 / LOAD_BUCKETS),
+			    LOAD_BUCKETS - 1))]++;
+			domstat[d].loadsum += domain[d].curcpu;
+			load_push(&domain[d], elapsed);
+			smp.load = domain[d].curcpu;
+			smp.up = load_estimate(&domain[d], upest);
+			smp.down = load_estimate(&domain[d], downest);
+			smp.overheating = hot;
+			if ((!daemonize) && (verbose) && ((upest != EST_RAW) || (downest != EST_RAW)))
+				printf("estd: estimate(%d) up %d down %d\n", d, smp.up, smp.down);
+			want = gov->decide(&domain[d], &smp, elapsed);
+			/* leases raise the floor, but never beat a limit or the heat */
+			newfreq = MAX(domain[d].minidx, MIN(MIN(domain[d].maxidx,
+			    domstat[d].thermidx), MAX(hot ? 0 : domstat[d].leaseidx, want)));
+			if (newfreq != domain[d].curfreq) {
+				domstat[d].transitions[domain[d].curfreq * domain[d].nfreqs + newfreq]++;
+				if ((newfreq < want) && (newfreq == domstat[d].thermidx))
+					reason = ESTD_EVENT_THERMAL;
+				else if ((newfreq > want) && (newfreq == domstat[d].leaseidx))
+					reason = ESTD_EVENT_LEASE;
+				else if (newfreq != want)
+					reason = ESTD_EVENT_LIMIT;
+				else if (newfreq > domain[d].curfreq)
+					reason = ESTD_EVENT_UP;
+				else
+					reason = hot ? ESTD_EVENT_OVERHEAT : ESTD_EVENT_DOWN;
+				event_record(d, reason, domain[d].curfreq, newfreq);
+				/* pid compares what was applied, not what it asked for */
+				if (gov == &gov_pid) {
+					ps = domain[d].govdata;
+					ps->transitions++;
+					if ((!daemonize) && (verbose))
+						printf("estd: pid(%d) %d transitions, smooth %d\n",
+						    d, ps->transitions, ps->smoothtransitions);
+				}
+			}
+			if (newfreq > domain[d].curfreq)
+				up = 1;
+			else if ((newfreq < domain[d].curfreq) && (newfreq == domain[d].minidx))
+				down = 1;
+			domain[d].curfreq = newfreq;
+			clock_gettime(CLOCK_MONOTONIC, &ts_end);
+			domstat[d].decisions++;
+			domstat[d].decidens += (ts_end.tv_sec - ts_start.tv_sec) * 1000000000 +
+			    (ts_end.tv_nsec - ts_start.tv_nsec);
+
+			if ((domain[d].curfreq != domain[d].minidx) || (domain[d].curcpu >= IDLE_LOAD))
+				*idle = 0;
+			if (((domain[d].curfreq > domain[d].minidx) && (domain[d].curfreq < domain[d].maxidx)) ||
+			    (domain[d].curcpu >= prevcpu + RISE_LOAD))
+				*moving = 1;
+		}
+	}
+
+	/* then switch everything that changed in one pass, set_freq skips the rest */
+	for (d = 0; d < ndomains; d++) {
+		clock_gettime(CLOCK_MONOTONIC, &ts_start);
+		set_freq(d);
+		clock_gettime(CLOCK_MONOTONIC, &ts_end);
+		domstat[d].decidens += (ts_end.tv_sec - ts_start.tv_sec) * 1000000000 +
+		    (ts_end.tv_nsec - ts_start.tv_nsec);
+	}
+	if (up)
+		set_clockmod(clockmod_max);
+	else if (down)
+		set_clockmod(clockmod_min);
+}
+
+/* microseconds from b to a */
+int64_t
+ts_diff(const struct timespec *a, const struct timespec *b)
+{
+	return (int64_t)(a->tv_sec - b->tv_sec) * 1000000 +
+	    (a->tv_nsec - b->tv_nsec) / 1000;
+}
+
+void
+ts_add(struct timespec *ts, useconds_t us)
+{
+	ts->tv_sec += us / 1000000;
+	ts->tv_nsec += (us % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/* -e up=raw|ewma|max|p90,down=...,halflife=us,window=n */
+int
+parse_estimator(const char *value)
+{
+	char *estnames[] = { "raw", "ewma", "max", "p90", NULL };
+	int est;
+
+	for (est = 0; (value != NULL) && (estnames[est] != NULL); est++)
+		if (strcmp(value, estnames[est]) == 0)
+			return est;
+
+	fprintf(stderr, "estd: Unknown load estimator %s\n", value ? value : "");
+	exit(1);
+}
+
+void
+parse_estimators(char *opts)
+{
+	char *subopts[] = { "up", "down", "halflife", "window", NULL };
+	char *value;
+
+	while (*opts != '\0') {
+		switch (getsubopt(&opts, subopts, &value)) {
+		case 0:
+			upest = parse_estimator(value);
+			break;
+		case 1:
+			downest = parse_estimator(value);
+			break;
+		case 2:
+			halflife = value ? atoi(value) : 0;
+			break;
+		case 3:
+			loadwindow = value ? atoi(value) : 0;
+			break;
+		default:
+			fprintf(stderr, "estd: -e expects up=, down=, halflife= or window=\n");
+			exit(1);
+		}
+	}
+	if ((halflife < 1) || (loadwindow < 1) || (loadwindow > LOAD_HIST)) {
+		fprintf(stderr, "estd: Invalid halflife or window (at most %d samples)\n", LOAD_HIST);
+		exit(1);
+	}
+}
+
+/* adaptive polling: back off while idle, tighten while the load moves */
+useconds_t
+next_poll(useconds_t cur, int idle, int moving)
+{
+	if (moving)
+		return MAX(MIN_POLL, MIN(cur, pollint) / 2);
+	if (idle)
+		return MIN(maxpoll, cur * 2);
+	return pollint;
+}
+
+/* copy the counters of one cpu from/to the platform independent trace layout */
+void
+cp_export(int cpu, u_int64_t *v)
+{
+#if defined(__DragonFly__)
+	v[0] = cp_time[cpu].cp_user;
+	v[1] = cp_time[cpu].cp_nice;
+	v[2] = cp_time[cpu].cp_sys;
+	v[3] = cp_time[cpu].cp_intr;
+	v[4] = cp_time[cpu].cp_idle;
+#else
+	v[0] = cp_time[cpu][CP_USER];
+	v[1] = cp_time[cpu][CP_NICE];
+	v[2] = cp_time[cpu][CP_SYS];
+# ifdef CP_SPIN
+	v[2] += cp_time[cpu][CP_SPIN];
+# endif
+	v[3] = cp_time[cpu][CP_INTR];
+	v[4] = cp_time[cpu][CP_IDLE];
+#endif
+}
+
+void
+cp_import(int cpu, const u_int64_t *v)
+{
+#if defined(__DragonFly__)
+	cp_time[cpu].cp_user = v[0];
+	cp_time[cpu].cp_nice = v[1];
+	cp_time[cpu].cp_sys = v[2];
+	cp_time[cpu].cp_intr = v[3];
+	cp_time[cpu].cp_idle = v[4];
+#else
+	memset(cp_time[cpu], 0, sizeof(cp_time[cpu]));
+	cp_time[cpu][CP_USER] = v[0];
+	cp_time[cpu][CP_NICE] = v[1];
+	cp_time[cpu][CP_SYS] = v[2];
+	cp_time[cpu][CP_INTR] = v[3];
+	cp_time[cpu][CP_IDLE] = v[4];
+#endif
+}
+
+/*
+ * Traces are a magic string followed by LEB128 varints: ncpus, ndomains, then
+ * per domain its cpus and frequency table. Every poll appends the elapsed
+ * time in us, the overheat flag, per domain the chosen curfreq, thermal cap
+ * and hot flag, and the counter deltas of each cpu since the previous poll.
+ * Version 1 traces lack the per-domain thermal cap and hot flag.
+ */
+void
+trace_putv(u_int64_t v)
+{
+	while (v >= 0x80) {
+		putc((v & 0x7f) | 0x80, tracefh);
+		v >>= 7;
+	}
+	putc(v, tracefh);
+}
+
+int
+trace_getv(FILE *fh, u_int64_t *v)
+{
+	int c, shift = 0;
+
+	*v = 0;
+	do {
+		if (((c = getc(fh)) == EOF) || (shift > 63))
+			return -1;
+		*v |= (u_int64_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return 0;
+}
+
+void
+trace_open(const char *file)
+{
+	int d, i;
+
+	if ((tracefh = fopen(file, "w")) == NULL) {
+		fprintf(stderr, "estd: Cannot create trace %s: %s\n", file, strerror(errno));
+		exit(1);
+	}
+	tracencpus = ncpus;
+	tracelast = ecalloc(tracencpus * TRACE_STATES, sizeof(u_int64_t));
+
+	fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC) - 1, tracefh);
+	trace_putv(tracencpus);
+	trace_putv(ndomains);
+	for (d = 0; d < ndomains; d++) {
+		trace_putv(domain[d].ncpus);
+		for (i = 0; i < domain[d].ncpus; i++)
+			trace_putv(domain[d].cpus[i]);
+		trace_putv(domain[d].nfreqs);
+		for (i = 0; i < domain[d].nfreqs; i++)
+			trace_putv(domain[d].freqtab[i]);
+	}
+}
+
+void
+trace_write(useconds_t elapsed, int overheating)
+{
+	u_int64_t v[TRACE_STATES];
+	int cpu, d, i;
+
+	trace_putv(elapsed);
+	trace_putv(overheating ? 1 : 0);
+	for (d = 0; d < ndomains; d++) {
+		trace_putv(domain[d].curfreq);
+		trace_putv(domstat[d].thermidx);
+		trace_putv(domstat[d].hot ? 1 : 0);
+	}
+	for (cpu = 0; cpu < tracencpus; cpu++) {
+		cp_export(cpu, v);
+		for (i = 0; i < TRACE_STATES; i++) {
+			trace_putv(v[i] - tracelast[cpu * TRACE_STATES + i]);
+			tracelast[cpu * TRACE_STATES + i] = v[i];
+		}
+	}
+}
+
+/* per-domain results of a replay or mock run */
+struct replaystat {
+	u_int64_t      *time;		/* replayed residency in us */
+	u_int64_t      *rectime;	/* recorded residency in us */
+	int		transitions;
+	int		rectransitions;
+	int		recfreq;
+	int		lastfreq;
+	int		inburst;		/* load is above high, max not reached yet */
+	u_int64_t	burst;
+	u_int64_t	reaction;
+	u_int64_t	maxreaction;
+	int		nbursts;
+	int		missed;			/* bursts over before reaching max */
+	u_int64_t	lastpoll;		/* us */
+	double		energy;		/* mock only, see mock_run() */
+};
+
+/* returns the trace version or -1 */
+int
+trace_readheader(FILE *fh)
+{
+	char magic[sizeof(TRACE_MAGIC) - 1];
+	u_int64_t v;
+	int d, i, version;
+
+	if (fread(magic, 1, sizeof(magic), fh) != sizeof(magic))
+		return -1;
+	if (memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0)
+		version = 2;
+	else if (memcmp(magic, TRACE_MAGIC_V1, sizeof(magic)) == 0)
+		version = 1;
+	else
+		return -1;
+
+	if ((trace_getv(fh, &v) < 0) || (v < 1))
+		return -1;
+	ncpus = v;
+	cp_alloc();
+	if ((trace_getv(fh, &v) < 0) || (v < 1))
+		return -1;
+	ndomains = v;
+	domain = ecalloc(ndomains, sizeof(struct domain));
+
+	for (d = 0; d < ndomains; d++) {
+		if ((trace_getv(fh, &v) < 0) || (v > (u_int64_t)ncpus))
+			return -1;
+		domain[d].ncpus = v;
+		domain[d].cpus = ecalloc(ncpus, sizeof(int));
+		for (i = 0; i < domain[d].ncpus; i++) {
+			if ((trace_getv(fh, &v) < 0) || (v >= (u_int64_t)ncpus))
+				return -1;
+			domain[d].cpus[i] = v;
+		}
+		if ((trace_getv(fh, &v) < 0) || (v < 1) || (v > TRACE_MAXFREQS))
+			return -1;
+		domain[d].nfreqs = v;
+		domain[d].freqtab = ecalloc(v, sizeof(int));
+		for (i = 0; i < domain[d].nfreqs; i++) {
+			if (trace_getv(fh, &v) < 0)
+				return -1;
+			domain[d].freqtab[i] = v;
+		}
+	}
+
+	return version;
+}
+
+void
+domstat_init(int d)
+{
+
+	memset(&domstat[d], 0, sizeof(struct domstat));
+	domstat[d].residency = ecalloc(domain[d].nfreqs, sizeof(u_int64_t));
+	domstat[d].transitions = ecalloc(domain[d].nfreqs * domain[d].nfreqs,
+	    sizeof(u_int64_t));
+	domstat[d].thermidx = domain[d].nfreqs - 1;
+	domstat[d].written = -1;
+}
+
+void
+domstat_alloc(void)
+{
+	int d;
+
+	domstat = ecalloc(ndomains, sizeof(struct domstat));
+	for (d = 0; d < ndomains; d++)
+		domstat_init(d);
+}
+
+/* user + system time of the whole process, sensor thread included, in us */
+u_int64_t
+cpu_used(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		return 0;
+	return (u_int64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+	    ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/* account a poll that kept the main loop busy for work us */
+void
+overhead_poll(int64_t work)
+{
+	static u_int64_t lastcpu;
+	u_int64_t cpu;
+
+	ovh.polls++;
+	ovh.worksum += work;
+	ovh.workmax = MAX(ovh.workmax, (u_int64_t)work);
+	if ((!daemonize) && (verbose)) {
+		cpu = cpu_used();
+		printf("estd: work %lld us (mean %llu, max %llu), cpu %llu us\n", (long long)work,
+		    (unsigned long long)((ovh.worksum - ovh.winwork) / (ovh.polls - ovh.winpolls)),
+		    (unsigned long long)ovh.workmax, (unsigned long long)(cpu - lastcpu));
+		lastcpu = cpu;
+	}
+}
+
+/*
+ * Sum up the overhead since the last summary, window us ago. The line is
+ * printed in the foreground and kept for the control socket.
+ */
+void
+overhead_summary(u_int64_t window)
+{
+	u_int64_t cpu, polls, sensorw;
+	double secs = window / 1000000.0;
+	size_t len;
+	int i;
+
+	cpu = cpu_used();
+	polls = MAX(ovh.polls - ovh.winpolls, 1);
+	sensorw = atomic_load_explicit(&sensorwakeups, memory_order_relaxed);
+	ovh.calls[CALL_SENSOR] = atomic_load_explicit(&sensorcalls, memory_order_relaxed);
+
+	len = snprintf(ovh.summary, sizeof(ovh.summary),
+	    "overhead over %.0f s: %llu polls, work %llu us mean %llu us max, "
+	    "cpu %.3f%% (%llu us/poll), wakeups %.1f/s (sensor %.1f/s), calls/s",
+	    secs, (unsigned long long)(ovh.polls - ovh.winpolls),
+	    (unsigned long long)((ovh.worksum - ovh.winwork) / polls),
+	    (unsigned long long)ovh.workmax, (cpu - ovh.wincpu) / 10000.0 / secs,
+	    (unsigned long long)((cpu - ovh.wincpu) / polls),
+	    (ovh.wakeups - ovh.winwakeups) / secs, (sensorw - ovh.winsensorwakeups) / secs);
+	for (i = 0; (i < CALLS) && (len < sizeof(ovh.summary)); i++)
+		len += snprintf(ovh.summary + len, sizeof(ovh.summary) - len, " %s %.1f",
+		    callname[i], (ovh.calls[i] - ovh.wincalls[i]) / secs);
+	if (!daemonize)
+		printf("estd: %s\n", ovh.summary);
+
+	ovh.winpolls = ovh.polls;
+	ovh.winwork = ovh.worksum;
+	ovh.workmax = 0;
+	ovh.winwakeups = ovh.wakeups;
+	ovh.winsensorwakeups = sensorw;
+	memcpy(ovh.wincalls, ovh.calls, sizeof(ovh.wincalls));
+	ovh.wincpu = cpu;
+}
+
+/*
+ * Dump the counters in the Prometheus text format. The file is written
+ * under a temporary name and renamed, so a scraper never sees half of it.
+ */
+void
+metrics_write(const char *path)
+{
+	struct pidstate *ps;
+	char tmp[PATH_MAX];
+	FILE *fh;
+	u_int64_t cum;
+	int d, i, j;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((fh = fopen(tmp, "w")) == NULL) {
+		if (!daemonize)
+			fprintf(stderr, "estd: Cannot write %s: %s\n", tmp, strerror(errno));
+		return;
+	}
+
+	fprintf(fh, "# HELP estd_frequency_seconds_total Time spent at each frequency.\n"
+	    "# TYPE estd_frequency_seconds_total counter\n");
+	for (d = 0; d < ndomains; d++)
+		for (i = 0; i < domain[d].nfreqs; i++)
+			fprintf(fh, "estd_frequency_seconds_total{domain=\"%d\",mhz=\"%d\"} %.6f\n",
+			    d, domain[d].freqtab[i], domstat[d].residency[i] / 1000000.0);
+
+	fprintf(fh, "# HELP estd_transitions_total Frequency transitions by source and target frequency.\n"
+	    "# TYPE estd_transitions_total counter\n");
+	for (d = 0; d < ndomains; d++)
+		for (i = 0; i < domain[d].nfreqs; i++)
+			for (j = 0; j < domain[d].nfreqs; j++)
+				if (i != j)
+					fprintf(fh, "estd_transitions_total{domain=\"%d\",from=\"%d\",to=\"%d\"} %llu\n",
+					    d, domain[d].freqtab[i], domain[d].freqtab[j],
+					    (unsigned long long)domstat[d].transitions[i * domain[d].nfreqs + j]);
+
+	fprintf(fh, "# HELP estd_overheat_seconds_total Time spent throttled because of overheating.\n"
+	    "# TYPE estd_overheat_seconds_total counter\n");
+	for (d = 0; d < ndomains; d++)
+		fprintf(fh, "estd_overheat_seconds_total{domain=\"%d\"} %.6f\n",
+		    d, domstat[d].overheat / 1000000.0);
+
+	fprintf(fh, "# HELP estd_temperature_celsius Latest reading of the sensors of a domain.\n"
+	    "# TYPE estd_temperature_celsius gauge\n");
+	for (d = 0; d < ndomains; d++)
+		if (domstat[d].sensed)
+			fprintf(fh, "estd_temperature_celsius{domain=\"%d\"} %.1f\n",
+			    d, domstat[d].degrees);
+	fprintf(fh, "# HELP estd_thermal_limit_mhz Highest frequency allowed by the thermal cap.\n"
+	    "# TYPE estd_thermal_limit_mhz gauge\n");
+	for (d = 0; d < ndomains; d++)
+		if (domstat[d].sensed)
+			fprintf(fh, "estd_thermal_limit_mhz{domain=\"%d\"} %d\n", d,
+			    domain[d].freqtab[MIN(domain[d].maxidx, domstat[d].thermidx)]);
+
+	if ((activegov != -1) && (governors[activegov] == &gov_pid)) {
+		fprintf(fh, "# HELP estd_pid_transitions_total Transitions made by pid and by smooth in its shadow.\n"
+		    "# TYPE estd_pid_transitions_total counter\n");
+		for (d = 0; d < ndomains; d++) {
+			if ((ps = domain[d].govdata) == NULL)
+				continue;
+			fprintf(fh, "estd_pid_transitions_total{domain=\"%d\",governor=\"pid\"} %d\n"
+			    "estd_pid_transitions_total{domain=\"%d\",governor=\"smooth\"} %d\n",
+			    d, ps->transitions, d, ps->smoothtransitions);
+		}
+	}
+
+	fprintf(fh, "# HELP estd_decision_load_percent Load seen at each frequency decision.\n"
+	    "# TYPE estd_decision_load_percent histogram\n");
+	for (d = 0; d < ndomains; d++) {
+		for (cum = 0, i = 0; i < LOAD_BUCKETS - 1; i++) {
+			cum += domstat[d].loadhist[i];
+			fprintf(fh, "estd_decision_load_percent_bucket{domain=\"%d\",le=\"%d\"} %llu\n",
+			    d, (i + 1) * (100 / LOAD_BUCKETS), (unsigned long long)cum);
+		}
+		fprintf(fh, "estd_decision_load_percent_bucket{domain=\"%d\",le=\"+Inf\"} %llu\n"
+		    "estd_decision_load_percent_sum{domain=\"%d\"} %llu\n"
+		    "estd_decision_load_percent_count{domain=\"%d\"} %llu\n",
+		    d, (unsigned long long)domstat[d].decisions,
+		    d, (unsigned long long)domstat[d].loadsum,
+		    d, (unsigned long long)domstat[d].decisions);
+	}
+
+	fprintf(fh, "# HELP estd_decision_latency_seconds Time spent deciding and setting the frequency.\n"
+	    "# TYPE estd_decision_latency_seconds summary\n");
+	for (d = 0; d < ndomains; d++)
+		fprintf(fh, "estd_decision_latency_seconds_sum{domain=\"%d\"} %.9f\n"
+		    "estd_decision_latency_seconds_count{domain=\"%d\"} %llu\n",
+		    d, domstat[d].decidens / 1000000000.0,
+		    d, (unsigned long long)domstat[d].decisions);
+
+	fprintf(fh, "# HELP estd_writes_total Frequency and clockmod writes, made or skipped because nothing changed.\n"
+	    "# TYPE estd_writes_total counter\n"
+	    "estd_writes_total{knob=\"frequency\",result=\"written\"} %llu\n"
+	    "estd_writes_total{knob=\"frequency\",result=\"skipped\"} %llu\n"
+	    "estd_writes_total{knob=\"clockmod\",result=\"written\"} %llu\n"
+	    "estd_writes_total{knob=\"clockmod\",result=\"skipped\"} %llu\n",
+	    (unsigned long long)freqwrites, (unsigned long long)freqskipped,
+	    (unsigned long long)clockmodwrites, (unsigned long long)clockmodskipped);
+
+	if ((replayfile == NULL) && (mockfile == NULL)) {
+		fprintf(fh, "# HELP estd_wakeup_jitter_seconds How late polls wake up after their deadline.\n"
+		    "# TYPE estd_wakeup_jitter_seconds histogram\n");
+		for (cum = 0, i = 0; i < JITTER_BUCKETS - 1; i++) {
+			cum += jitterhist[i];
+			fprintf(fh, "estd_wakeup_jitter_seconds_bucket{le=\"%g\"} %llu\n",
+			    (10 << (2 * i)) / 1000000.0, (unsigned long long)cum);
+		}
+		cum += jitterhist[i];
+		fprintf(fh, "estd_wakeup_jitter_seconds_bucket{le=\"+Inf\"} %llu\n"
+		    "estd_wakeup_jitter_seconds_sum %.6f\n"
+		    "estd_wakeup_jitter_seconds_count %llu\n",
+		    (unsigned long long)cum, jittersum / 1000000.0, (unsigned long long)cum);
+		fprintf(fh, "# HELP estd_poll_overruns_total Polls that missed a whole interval.\n"
+		    "# TYPE estd_poll_overruns_total counter\n"
+		    "estd_poll_overruns_total %llu\n", (unsigned long long)overruns);
+
+		ovh.calls[CALL_SENSOR] = atomic_load_explicit(&sensorcalls, memory_order_relaxed);
+		fprintf(fh, "# HELP estd_work_seconds Time the main loop spends working per poll.\n"
+		    "# TYPE estd_work_seconds summary\n"
+		    "estd_work_seconds_sum %.6f\n"
+		    "estd_work_seconds_count %llu\n"
+		    "# HELP estd_cpu_seconds_total User and system time used by estd.\n"
+		    "# TYPE estd_cpu_seconds_total counter\n"
+		    "estd_cpu_seconds_total %.6f\n"
+		    "# HELP estd_wakeups_total Times estd woke up.\n"
+		    "# TYPE estd_wakeups_total counter\n"
+		    "estd_wakeups_total{thread=\"main\"} %llu\n"
+		    "estd_wakeups_total{thread=\"sensor\"} %llu\n"
+		    "# HELP estd_calls_total sysctl and sysfs calls by purpose.\n"
+		    "# TYPE estd_calls_total counter\n",
+		    ovh.worksum / 1000000.0, (unsigned long long)ovh.polls,
+		    cpu_used() / 1000000.0, (unsigned long long)ovh.wakeups,
+		    (unsigned long long)atomic_load_explicit(&sensorwakeups, memory_order_relaxed));
+		for (i = 0; i < CALLS; i++)
+			fprintf(fh, "estd_calls_total{purpose=\"%s\"} %llu\n", callname[i],
+			    (unsigned long long)ovh.calls[i]);
+	}
+
+	if ((fclose(fh) != 0) || (rename(tmp, path) < 0)) {
+		if (!daemonize)
+			fprintf(stderr, "estd: Cannot write %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+	}
+}
+
+/* create and map the status page */
+void
+status_open(const char *path)
+{
+	int fd;
+
+	if (((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) ||
+	    (ftruncate(fd, sizeof(struct estd_status)) < 0)) {
+		fprintf(stderr, "estd: Cannot create status page %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	status = mmap(NULL, sizeof(struct estd_status), PROT_READ | PROT_WRITE,
+	    MAP_SHARED, fd, 0);
+	close(fd);
+	if (status == MAP_FAILED) {
+		fprintf(stderr, "estd: Cannot map status page %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	status->magic = ESTD_STATUS_MAGIC;
+	status->version = ESTD_STATUS_VERSION;
+	status->size = sizeof(struct estd_status);
+	status->pid = getpid();
+}
+
+/* publish the state after a poll, see estd.h for the reader side */
+void
+status_update(const struct timespec *now)
+{
+	struct estd_domain_status *ds;
+	int d;
+
+	status->seq++;
+	atomic_thread_fence(memory_order_release);
+
+	status->polls++;
+	status->updated = (u_int64_t)now->tv_sec * 1000000 + now->tv_nsec / 1000;
+	status->ndomains = ndomains;
+	strlcpy(status->strategy, governors[activegov]->name, sizeof(status->strategy));
+	for (d = 0; (d < ndomains) && (d < ESTD_STATUS_DOMAINS); d++) {
+		ds = &status->domain[d];
+		ds->load = domain[d].curcpu;
+		ds->freqidx = domain[d].curfreq;
+		ds->mhz = domain[d].freqtab[domain[d].curfreq];
+		ds->minmhz = domain[d].freqtab[domain[d].minidx];
+		ds->maxmhz = domain[d].freqtab[domain[d].maxidx];
+		ds->thermalmhz = domain[d].freqtab[MIN(domain[d].maxidx, domstat[d].thermidx)];
+		ds->overheat = domstat[d].hot || (domstat[d].thermidx < domain[d].maxidx);
+		ds->temperature = domstat[d].sensed ? domstat[d].degrees * 1000 : 0;
+		ds->lowtime = domain[d].lowtime;
+		ds->ncpus = domain[d].ncpus;
+	}
+
+	atomic_thread_fence(memory_order_release);
+	status->seq++;
+}
+
+/* account the poll of v us that is about to be decided */
+void
+replaystat_before(struct replaystat *st, u_int64_t v)
+{
+	int d;
+
+	for (d = 0; d < ndomains; d++) {
+		st[d].time[domain[d].curfreq] += v;
+		st[d].lastfreq = domain[d].curfreq;
+		st[d].lastpoll = v;
+		if (st[d].inburst)
+			st[d].burst += v;
+	}
+}
+
+/*
+ * count transitions and the time from load above high until maxidx. A
+ * burst starts with the interval of the poll that first sees it; one that
+ * ends before maxidx is reached counts as missed.
+ */
+void
+replaystat_after(struct replaystat *st)
+{
+	int d;
+
+	for (d = 0; d < ndomains; d++) {
+		if (domain[d].curfreq != st[d].lastfreq)
+			st[d].transitions++;
+		if ((!st[d].inburst) && (domain[d].curcpu > high) &&
+		    (st[d].lastfreq < domain[d].maxidx)) {
+			st[d].inburst = 1;
+			st[d].burst = st[d].lastpoll;
+		}
+		if (st[d].inburst && (domain[d].curfreq == domain[d].maxidx)) {
+			st[d].inburst = 0;
+			st[d].nbursts++;
+			st[d].reaction += st[d].burst;
+			st[d].maxreaction = MAX(st[d].maxreaction, st[d].burst);
+		} else if (st[d].inburst && (domain[d].curcpu != -1) && (domain[d].curcpu < low)) {
+			st[d].inburst = 0;
+			st[d].missed++;
+		}
+	}
+}
+
+void
+replaystat_print(const struct replaystat *st)
+{
+	if (st->nbursts > 0)
+		printf(", time to max %.1f ms mean, %.1f ms max over %d bursts",
+		    st->reaction / 1000.0 / st->nbursts, st->maxreaction / 1000.0,
+		    st->nbursts);
+	if (st->missed > 0)
+		printf(", %d bursts missed max", st->missed);
+}
+
+/* feed a recorded trace through update_domains() as fast as possible and report */
+int
+replay(const char *file)
+{
+	FILE *fh;
+	const char *err;
+	struct replaystat *st;
+	struct timespec ts_start, ts_end;
+	u_int64_t v, flags, total = 0, sum, thermidx, hot;
+	int cpu, d, i, npolls = 0, idle, moving, version;
+
+	if ((fh = fopen(file, "r")) == NULL) {
+		fprintf(stderr, "estd: Cannot open trace %s: %s\n", file, strerror(errno));
+		exit(1);
+	}
+	if ((version = trace_readheader(fh)) < 0) {
+		fprintf(stderr, "estd: %s is not a valid trace\n", file);
+		exit(1);
+	}
+	tracelast = ecalloc(ncpus * TRACE_STATES, sizeof(u_int64_t));
+	st = ecalloc(ndomains, sizeof(struct replaystat));
+	domstat_alloc();
+	for (d = 0; d < ndomains; d++) {
+		st[d].time = ecalloc(domain[d].nfreqs, sizeof(u_int64_t));
+		st[d].rectime = ecalloc(domain[d].nfreqs, sizeof(u_int64_t));
+		if ((err = domain_limits(d, minmhz, maxmhz, 1)) != NULL) {
+			fprintf(stderr, "estd: %s\n", err);
+			exit(1);
+		}
+		domain[d].curfreq = domain[d].minidx;
+		st[d].recfreq = -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts_start);
+	while (trace_getv(fh, &v) == 0) {
+		if (trace_getv(fh, &flags) < 0)
+			break;
+		evclock += v;
+
+		for (d = 0; d < ndomains; d++) {
+			if (trace_getv(fh, &sum) < 0)
+				goto truncated;
+			if (st[d].recfreq >= 0) {
+				st[d].rectime[st[d].recfreq] += v;
+				if (st[d].recfreq != (int)sum)
+					st[d].rectransitions++;
+			}
+			st[d].recfreq = MIN(sum, (u_int64_t)domain[d].nfreqs - 1);
+			if (version < 2)
+				continue;
+
+			/* the recorded thermal cap replaces the sensors */
+			if ((trace_getv(fh, &thermidx) < 0) || (trace_getv(fh, &hot) < 0))
+				goto truncated;
+			thermidx = MIN(thermidx, (u_int64_t)domain[d].nfreqs - 1);
+			if ((int)thermidx != domstat[d].thermidx)
+				event_record(d, ESTD_EVENT_CAP, domstat[d].thermidx, thermidx);
+			domstat[d].thermidx = thermidx;
+			domstat[d].hot = hot & 1;
+		}
+
+		cp_save();
+		for (cpu = 0; cpu < ncpus; cpu++) {
+			for (i = 0; i < TRACE_STATES; i++) {
+				if (trace_getv(fh, &sum) < 0)
+					goto truncated;
+				tracelast[cpu * TRACE_STATES + i] += sum;
+			}
+			cp_import(cpu, &tracelast[cpu * TRACE_STATES]);
+		}
+
+		replaystat_before(st, v);
+		update_domains((version < 2) && (flags & 1), v, &idle, &moving);
+		npolls++;
+		total += v;
+		replaystat_after(st);
+	}
+	goto done;
+
+ truncated:
+	fprintf(stderr, "estd: %s is truncated, stopping after %d polls\n", file, npolls);
+ done:
+	clock_gettime(CLOCK_MONOTONIC, &ts_end);
+	fclose(fh);
+
+	printf("estd: replayed %d polls covering %.1f s in %.3f s\n", npolls,
+	    total / 1000000.0, (ts_end.tv_sec - ts_start.tv_sec) +
+	    (ts_end.tv_nsec - ts_start.tv_nsec) / 1000000000.0);
+	for (d = 0; d < ndomains; d++) {
+		printf("Domain %d: %d transitions (recorded %d)", d,
+		    st[d].transitions, st[d].rectransitions);
+		replaystat_print(&st[d]);
+		printf("\n");
+		for (i = 0; i < domain[d].nfreqs; i++) {
+			if (total == 0)
+				break;
+			printf("%6i MHz %5.1f%% (recorded %5.1f%%)\n", domain[d].freqtab[i],
+			    st[d].time[i] * 100.0 / total, st[d].rectime[i] * 100.0 / total);
+		}
+	}
+
+	if (metricsfile != NULL)
+		metrics_write(metricsfile);
+	for (d = 0; (activegov != -1) && (d < ndomains); d++)
+		if (governors[activegov]->teardown != NULL)
+			governors[activegov]->teardown(&domain[d]);
+	if ((eventfile != NULL) && (event_dump(eventfile) < 0))
+		fprintf(stderr, "estd: Cannot write %s: %s\n", eventfile, strerror(errno));
+
+	return 0;
+}
+
+/*
+ * Control socket: one command per line, every answer ends with a line that
+ * is either "ok" or "error <reason>".
+ *
+ *	status			one line per domain: load, MHz, residency
+ *	overhead		the last overhead summary
+ *	get			current tunables
+ *	set name=value ...	change high, low, lowgrace, minmhz, maxmhz
+ *				and strategy together or not at all
+ *	lease mhz=n|max [domain=n] [duration=us]
+ *				hold a minimum frequency, answers its id
+ *	release [id]		end one or all leases of this client
+ *	leases			all active leases
+ */
+void
+ctl_open(const char *path)
+{
+	struct sockaddr_un sun;
+	int i;
+
+	for (i = 0; i < CTL_MAXCLIENTS; i++)
+		clients[i].fd = -1;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "estd: Control socket path too long\n");
+		exit(1);
+	}
+	unlink(path);
+	if (((ctlfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) ||
+	    (bind(ctlfd, (struct sockaddr *)&sun, sizeof(sun)) < 0) ||
+	    (chmod(path, 0600) < 0) || (listen(ctlfd, CTL_MAXCLIENTS) < 0)) {
+		fprintf(stderr, "estd: Cannot create control socket %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	fcntl(ctlfd, F_SETFL, fcntl(ctlfd, F_GETFL) | O_NONBLOCK);
+}
+
+/*
+ * QoS leases: a client can hold a minimum frequency for one or all domains,
+ * e.g. for a latency-critical job, until the lease expires, is released or
+ * the client disconnects, whichever comes first. The highest lease of a
+ * domain is a floor over minidx; the maximum and the thermal cap still win.
+ */
+
+/* end the leases of c, all of them if id is 0; returns how many */
+int
+lease_drop(struct client *c, int id)
+{
+	int i, n = 0;
+
+	for (i = 0; i < LEASE_MAX; i++) {
+		if ((leases[i].id == 0) || (leases[i].client != c) ||
+		    ((id != 0) && (leases[i].id != id)))
+			continue;
+		leases[i].id = 0;
+		n++;
+	}
+	if (n > 0)
+		wakeup = 1;
+	return n;
+}
+
+/* end the leases that ran out; returns us until the next one does, or -1 */
+int64_t
+lease_expire(const struct timespec *now)
+{
+	int64_t left, next = -1;
+	int i;
+
+	for (i = 0; i < LEASE_MAX; i++) {
+		if ((leases[i].id == 0) || (leases[i].expires.tv_sec == 0))
+			continue;
+		if ((left = ts_diff(&leases[i].expires, now)) <= 0) {
+			leases[i].id = 0;
+			wakeup = 1;
+		} else if ((next < 0) || (left < next))
+			next = left;
+	}
+	return next;
+}
+
+/* the floor of each domain, the lowest frequency that satisfies every lease */
+void
+lease_apply(void)
+{
+	int d, i, idx;
+
+	for (d = 0; d < ndomains; d++)
+		domstat[d].leaseidx = 0;
+	for (i = 0; i < LEASE_MAX; i++) {
+		if (leases[i].id == 0)
+			continue;
+		for (d = 0; d < ndomains; d++) {
+			if ((leases[i].domain != -1) && (leases[i].domain != d))
+				continue;
+			for (idx = 0; (idx < domain[d].nfreqs - 1) &&
+			    (domain[d].freqtab[idx] < leases[i].mhz); idx++)
+				;
+			domstat[d].leaseidx = MAX(domstat[d].leaseidx, idx);
+		}
+	}
+}
+
+void
+ctl_close(struct client *c)
+{
+	lease_drop(c, 0);
+	close(c->fd);
+	c->fd = -1;
+	c->len = 0;
+}
+
+/* answers are small, a client that doesn't read them loses them */
+void
+ctl_printf(struct client *c, const char *fmt, ...)
+{
+	char buf[CTL_LINEMAX * 4];
+	va_list ap;
+	int len;
+#ifdef MSG_NOSIGNAL
+	int flags = MSG_NOSIGNAL;
+#else
+	int flags = 0;
+#endif
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len > 0)
+		send(c->fd, buf, MIN(len, (int)sizeof(buf) - 1), flags);
+}
+
+int
+governor_lookup(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ngovernors; i++)
+		if (strcmp(governors[i]->name, name) == 0)
+			return i;
+	return -1;
+}
+
+void
+ctl_set(struct client *c, char *args)
+{
+	int nhigh = high, nlow = low, nminmhz = minmhz, nmaxmhz = maxmhz;
+	int nstrategy = strategy;
+	useconds_t nlowgrace = lowgrace;
+	const char *err;
+	char *arg, *val;
+	int d;
+
+	while ((arg = strsep(&args, " \t")) != NULL) {
+		if (*arg == '\0')
+			continue;
+		if ((val = strchr(arg, '=')) == NULL) {
+			ctl_printf(c, "error expected name=value\n");
+			return;
+		}
+		*val++ = '\0';
+		if (strcmp(arg, "high") == 0)
+			nhigh = atoi(val);
+		else if (strcmp(arg, "low") == 0)
+			nlow = atoi(val);
+		else if (strcmp(arg, "lowgrace") == 0)
+			nlowgrace = atoi(val);
+		else if (strcmp(arg, "minmhz") == 0)
+			nminmhz = atoi(val);
+		else if (strcmp(arg, "maxmhz") == 0)
+			nmaxmhz = atoi(val);
+		else if (strcmp(arg, "strategy") == 0) {
+			if ((nstrategy = governor_lookup(val)) < 0) {
+				ctl_printf(c, "error unknown governor %s\n", val);
+				return;
+			}
+		} else {
+			ctl_printf(c, "error unknown setting %s\n", arg);
+			return;
+		}
+	}
+
+	if (!valid_watermarks(nhigh, nlow)) {
+		ctl_printf(c, "error invalid high/low watermark combination\n");
+		return;
+	}
+	if (nminmhz > nmaxmhz) {
+		ctl_printf(c, "error invalid minimum/maximum MHz combination\n");
+		return;
+	}
+	for (d = 0; d < ndomains; d++) {
+		if ((err = domain_limits(d, nminmhz, nmaxmhz, 0)) != NULL) {
+			ctl_printf(c, "error domain %d: %s\n", d, err);
+			return;
+		}
+	}
+
+	high = nhigh;
+	low = nlow;
+	lowgrace = nlowgrace;
+	minmhz = nminmhz;
+	maxmhz = nmaxmhz;
+	strategy = nstrategy;
+	for (d = 0; d < ndomains; d++)
+		domain_limits(d, minmhz, maxmhz, 1);
+	wakeup = 1;
+	ctl_printf(c, "ok\n");
+}
+
+void
+ctl_lease(struct client *c, char *args)
+{
+	struct lease *l;
+	struct timespec now;
+	int mhz = 0, dom = -1, i;
+	long long duration = 0;
+	char *arg, *val, *end;
+
+	while ((arg = strsep(&args, " \t")) != NULL) {
+		if (*arg == '\0')
+			continue;
+		if ((val = strchr(arg, '=')) == NULL) {
+			ctl_printf(c, "error expected name=value\n");
+			return;
+		}
+		*val++ = '\0';
+		if (strcmp(arg, "mhz") == 0)
+			mhz = (strcmp(val, "max") == 0) ? INT_MAX : atoi(val);
+		else if (strcmp(arg, "domain") == 0) {
+			dom = strtol(val, &end, 10);
+			if ((*val == '\0') || (*end != '\0') || (dom < 0) || (dom >= ndomains)) {
+				ctl_printf(c, "error no domain %s\n", val);
+				return;
+			}
+		} else if (strcmp(arg, "duration") == 0) {
+			if ((duration = atoll(val)) <= 0) {
+				ctl_printf(c, "error invalid duration %s\n", val);
+				return;
+			}
+		} else {
+			ctl_printf(c, "error unknown setting %s\n", arg);
+			return;
+		}
+	}
+	if (mhz <= 0) {
+		ctl_printf(c, "error expected mhz=n or mhz=max\n");
+		return;
+	}
+
+	for (i = 0; (i < LEASE_MAX) && (leases[i].id != 0); i++)
+		;
+	if (i == LEASE_MAX) {
+		ctl_printf(c, "error too many leases\n");
+		return;
+	}
+	l = &leases[i];
+	l->id = ++leaseid;
+	l->client = c;
+	l->domain = dom;
+	l->mhz = mhz;
+	l->expires.tv_sec = 0;
+	l->expires.tv_nsec = 0;
+	if (duration > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		l->expires.tv_sec = now.tv_sec + duration / 1000000;
+		l->expires.tv_nsec = now.tv_nsec + (duration % 1000000) * 1000;
+		if (l->expires.tv_nsec >= 1000000000) {
+			l->expires.tv_sec++;
+			l->expires.tv_nsec -= 1000000000;
+		}
+	}
+	wakeup = 1;
+	ctl_printf(c, "lease %d\nok\n", l->id);
+}
+
+void
+ctl_command(struct client *c, char *line)
+{
+	char *cmd;
+	int d, i;
+	u_int64_t total;
+	struct timespec now;
+
+	cmd = strsep(&line, " \t");
+	if (strcmp(cmd, "status") == 0) {
+		for (d = 0; d < ndomains; d++) {
+			ctl_printf(c, "domain %d load %d mhz %d minmhz %d maxmhz %d lowtime %u",
+			    d, domain[d].curcpu, domain[d].freqtab[domain[d].curfreq],
+			    domain[d].freqtab[domain[d].minidx],
+			    domain[d].freqtab[domain[d].maxidx],
+			    (unsigned int)domain[d].lowtime);
+			for (total = 0, i = 0; i < domain[d].nfreqs; i++)
+				total += domstat[d].residency[i];
+			for (i = 0; i < domain[d].nfreqs; i++)
+				ctl_printf(c, " %d:%.1f%%", domain[d].freqtab[i], total ?
+				    domstat[d].residency[i] * 100.0 / total : 0.0);
+			ctl_printf(c, "\n");
+		}
+		ctl_printf(c, "ok\n");
+	} else if (strcmp(cmd, "get") == 0) {
+		ctl_printf(c, "high=%d low=%d lowgrace=%u minmhz=%d maxmhz=%d strategy=%s\nok\n",
+		    high, low, (unsigned int)lowgrace, minmhz, maxmhz,
+		    governors[strategy]->name);
+	} else if (strcmp(cmd, "overhead") == 0) {
+		ctl_printf(c, "%s\nok\n", (ovh.summary[0] != '\0') ? ovh.summary :
+		    "no summary yet");
+	} else if (strcmp(cmd, "set") == 0) {
+		ctl_set(c, line != NULL ? line : "");
+	} else if (strcmp(cmd, "lease") == 0) {
+		ctl_lease(c, line != NULL ? line : "");
+	} else if (strcmp(cmd, "release") == 0) {
+		if (lease_drop(c, (line != NULL) ? atoi(line) : 0) == 0)
+			ctl_printf(c, "error no such lease\n");
+		else
+			ctl_printf(c, "ok\n");
+	} else if (strcmp(cmd, "leases") == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (i = 0; i < LEASE_MAX; i++) {
+			if (leases[i].id == 0)
+				continue;
+			if (leases[i].mhz == INT_MAX)
+				ctl_printf(c, "lease %d domain %d mhz max", leases[i].id,
+				    leases[i].domain);
+			else
+				ctl_printf(c, "lease %d domain %d mhz %d", leases[i].id,
+				    leases[i].domain, leases[i].mhz);
+			if (leases[i].expires.tv_sec != 0)
+				ctl_printf(c, " left %lld", (long long)ts_diff(&leases[i].expires, &now));
+			ctl_printf(c, "%s\n", (leases[i].client == c) ? " mine" : "");
+		}
+		ctl_printf(c, "ok\n");
+	} else if (*cmd != '\0')
+		ctl_printf(c, "error unknown command %s\n", cmd);
+}
+
+void
+ctl_input(struct client *c)
+{
+	char *nl, *line;
+	ssize_t n;
+
+	n = read(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+	if (n <= 0) {
+		if ((n < 0) && (errno == EAGAIN || errno == EINTR))
+			return;
+		ctl_close(c);
+		return;
+	}
+	c->len += n;
+	c->buf[c->len] = '\0';
+
+	line = c->buf;
+	while ((nl = strchr(line, '\n')) != NULL) {
+		*nl = '\0';
+		if ((nl > line) && (nl[-1] == '\r'))
+			nl[-1] = '\0';
+		ctl_command(c, line);
+		line = nl + 1;
+	}
+	c->len -= line - c->buf;
+	memmove(c->buf, line, c->len);
+	if (c->len == sizeof(c->buf) - 1) {
+		ctl_printf(c, "error line too long\n");
+		ctl_close(c);
+	}
+}
+
+/*
+ * sleep until the absolute CLOCK_MONOTONIC deadline while serving the
+ * control socket; returns 0 when the deadline was reached and 1 when a
+ * command that changed the configuration or a signal ended the sleep early.
+ * A wakeup that came in while the main loop was working ends it at once.
+ */
+int
+ctl_wait(const struct timespec *deadline)
+{
+	struct pollfd pfd[CTL_MAXCLIENTS + 1];
+	struct client *pc[CTL_MAXCLIENTS + 1];
+	struct timespec now;
+	int64_t left, next;
+	int fd, i, n;
+
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((left = ts_diff(deadline, &now)) <= 0) {
+			wakeup = 0;	/* the poll is due anyway */
+			return 0;
+		}
+		next = lease_expire(&now);
+		if (wakeup) {
+			wakeup = 0;
+			return 1;
+		}
+
+		n = 0;
+		if (ctlfd >= 0) {
+			pfd[n].fd = ctlfd;
+			pfd[n].events = POLLIN;
+			pc[n++] = NULL;
+		}
+		for (i = 0; i < CTL_MAXCLIENTS; i++) {
+			if (clients[i].fd < 0)
+				continue;
+			pfd[n].fd = clients[i].fd;
+			pfd[n].events = POLLIN;
+			pc[n++] = &clients[i];
+		}
+
+		/*
+		 * poll() only has millisecond resolution, sleep the rest of
+		 * the way to the deadline
+		 */
+		if ((n == 0) || (left < 1000)) {
+#if defined(__OpenBSD__)
+			struct timespec rel = { left / 1000000, (left % 1000000) * 1000 };
+
+			nanosleep(&rel, NULL);
+#else
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL);
+#endif
+			ovh.wakeups++;
+			continue;
+		}
+		i = poll(pfd, n, ((next >= 0) && (next < left)) ? (next + 999) / 1000 : left / 1000);
+		ovh.wakeups++;
+		if (i <= 0)
+			continue;
+
+		for (i = 0; i < n; i++) {
+			if (pfd[i].revents == 0)
+				continue;
+			if (pc[i] != NULL) {
+				ctl_input(pc[i]);
+				continue;
+			}
+			if ((fd = accept(ctlfd, NULL, NULL)) < 0)
+				continue;
+			for (n = 0; (n < CTL_MAXCLIENTS) && (clients[n].fd >= 0); n++)
+				;
+			if (n == CTL_MAXCLIENTS) {
+				close(fd);
+				break;
+			}
+#ifdef SO_NOSIGPIPE
+			setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &(int){1}, sizeof(int));
+#endif
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+			clients[n].fd = fd;
+			clients[n].len = 0;
+			break;
+		}
+	}
+}
+
+/* number of cpus the kernel reports, -1 if it won't tell */
+int
+get_ncpus(void)
+{
+	int n;
+#if defined(__DragonFly__)
+	if (kinfo_get_cpus(&n))
+		return -1;
+#elif defined(__linux__)
+	n = sysconf(_SC_NPROCESSORS_CONF);
+#else
+	size_t len = sizeof(n);
+	int ncpumib[] = {CTL_HW, HW_NCPU};
+
+	if (sysctl(ncpumib, 2, &n, &len, NULL, 0) < 0)
+		return -1;
+#endif
+	return (n < 1) ? -1 : n;
+}
+
+/*
+ * build the domain table for the current cpus. The frequency tables are
+ * left to domain_freqs(), except on Linux where they come with the policy.
+ */
+void
+domains_init(void)
+{
+	int d, i, j;
+
+	ndomains = 1;
+	domain = ecalloc(ndomains, sizeof(struct domain));
+	domain[0].ncpus = ncpus;
+	domain[0].cpus = ecalloc(ncpus, sizeof(int));
+	for (i = 0; i < domain[0].ncpus; i++)
+		domain[0].cpus[i] = i;
+
+#if defined(__linux__)
+	if (linux_init()) {
+		fprintf(stderr, "estd: Cannot find a cpufreq policy (maybe the cpufreq driver isn't loaded?)\n");
+		exit(1);
+	}
+#elif !defined(__OpenBSD__)
+	if (tech == TECH_ACPI) {
+		if (acpi_init()) {
+			fprintf(stderr, "estd: Cannot ACPI P-States\n");
+			exit(1);
+		}
+	} else {
+		domain[0].freqctl = freqctl[tech];
+		domain[0].setctl = setctl[tech];
+	}
+#endif
+	/* each domain only looks at its own members, drop the ones we have no counters for */
+	for (d = 0; d < ndomains; d++) {
+		for (i = 0, j = 0; i < domain[d].ncpus; i++) {
+			if ((domain[d].cpus[i] >= 0) && (domain[d].cpus[i] < ncpus))
+				domain[d].cpus[j++] = domain[d].cpus[i];
+		}
+		domain[d].ncpus = j;
+		if (domain[d].ncpus == 0) {
+			fprintf(stderr, "estd: Domain %d has no usable cpus\n", d);
+			exit(1);
+		}
+	}
+}
+
+#if !defined(__linux__)
+/* get the supported frequencies of domain d, sorted in ascending order */
+void
+domain_freqs(int d)
+{
+#if defined(__OpenBSD__)
+	int hw_perfpolicy[] = {CTL_HW, HW_PERFPOLICY};
+	int hw_setperf[] = {CTL_HW, HW_SETPERF};
+	int hw_cpuspeed[] = {CTL_HW, HW_CPUSPEED};
+	int i, idx, val;
+	int cpuclock;
+	size_t val_size = sizeof(val);
+
+	if (sysctl(hw_perfpolicy, 2, NULL, NULL,
+	    "manual", sizeof("manual") - 1) < 0) {
+		fprintf(stderr, "estd: sysctl: hw.perfpolicy: %s",
+		    strerror(errno));
+		exit(1);
+	}
+
+	idx = 0;
+	cpuclock = -1;
+	domain[d].freqtab = ecalloc(51, sizeof(int));
+	domain[d].freqtab2perf = ecalloc(51, sizeof(int));
+	for (i = 0; i <= 100; i += 2) {
+		val = i;
+		if (sysctl(hw_setperf, 2, NULL, NULL,
+		    &val, sizeof(val)) < 0) {
+			fprintf(stderr, "estd: sysctl: hw.setperf: %s",
+			    strerror(errno));
+			exit(1);
+		}
+
+		if (sysctl(hw_cpuspeed, 2, &val, &val_size,
+		    NULL, 0) < 0) {
+			fprintf(stderr, "estd: sysctl: hw.cpuspeed: %s",
+			    strerror(errno));
+			exit(1);
+		}
+
+		if (cpuclock != val) {
+			cpuclock = val;
+			domain[d].freqtab[idx] = cpuclock;
+			domain[d].freqtab2perf[idx] = i;
+			idx++;
+		}
+	}
+	domain[d].minidx = 0;
+	domain[d].maxidx = idx - 1;
+	domain[d].nfreqs = idx;
+#else
+	char            frequencies[SYSCTLBUF];	/* XXX Ugly */
+	size_t          freqsize = sizeof(frequencies);
+
+	if (sysctlbyname(domain[d].freqctl, &frequencies, &freqsize, NULL, 0) < 0) {
+		fprintf(stderr, "estd: Cannot get supported frequencies (maybe you forced the wrong CPU-scaling technology?)\n");
+		exit(1);
+	}
+	domain[d].nfreqs = parse_freqs(frequencies, &domain[d].freqtab);
+	if (domain[d].nfreqs <= 0) {
+		fprintf(stderr, "estd: No supported frequencies found?! (please report this error)\n");
+		exit(1);
+	}
+	qsort(domain[d].freqtab, domain[d].nfreqs, sizeof(domain[d].freqtab[0]), &freqcmp);
+#endif
+}
+#endif
+
+void
+domain_free(struct domain *dom)
+{
+	free(dom->cpus);
+	if ((tech == TECH_ACPI) || (tech == TECH_LINUX)) {
+		free(dom->freqctl);
+		free(dom->setctl);
+#if defined(__linux__)
+		free(dom->govctl);
+#endif
+	}
+}
+
+/* do two domains have a cpu in common */
+int
+domain_overlaps(const struct domain *a, const struct domain *b)
+{
+	int i, j;
+
+	for (i = 0; i < a->ncpus; i++)
+		for (j = 0; j < b->ncpus; j++)
+			if (a->cpus[i] == b->cpus[j])
+				return 1;
+	return 0;
+}
+
+/* cheap check whether cpus came or went since the domains were built */
+int
+topology_changed(void)
+{
+#if defined(__linux__)
+	char buf[SYSCTLBUF];
+	ssize_t len;
+
+	if (onlinefd >= 0) {
+		ovh.calls[CALL_TOPOLOGY]++;
+		len = pread(onlinefd, buf, sizeof(buf) - 1, 0);
+		if (len > 0) {
+			buf[len] = '\0';
+			if (strcmp(buf, linux_online) != 0)
+				return 1;
+		}
+	}
+#endif
+	ovh.calls[CALL_TOPOLOGY]++;
+	return topochanged || (get_ncpus() != ncpus);
+}
+
+/*
+ * Rebuild the domain table and the counter buffers after cpus went offline
+ * or came back. A new domain that shares a cpu with an old one takes over
+ * its frequency, grace period, load history, governor state and statistics.
+ */
+void
+topology_rebuild(void)
+{
+	struct domain  *old = domain;
+	struct domstat *oldstat = domstat;
+	int            *claimed;	/* new index + 1 of each old domain */
+	int             nold = ndomains, d, o, i, mhz;
+	const char     *err;
+
+	topochanged = 0;
+	if ((i = get_ncpus()) < 0) {
+		fprintf(stderr, "estd: Cannot get number of cpus\n");
+		exit(1);
+	}
+	ncpus = i;
+
+	/* the trace header describes the old layout */
+	if (tracefh != NULL) {
+		fprintf(stderr, "estd: cpus changed, trace recording stopped\n");
+		fclose(tracefh);
+		tracefh = NULL;
+	}
+
+	domains_init();
+	free(cp_time);
+	free(cp_old);
+	cp_alloc();
+	/* the next poll computes its load against this snapshot */
+	get_cputime();
+	topochanged = 0;
+	domstat = ecalloc(ndomains, sizeof(struct domstat));
+	claimed = ecalloc(nold, sizeof(int));
+
+	for (d = 0; d < ndomains; d++) {
+		for (o = 0; o < nold; o++)
+			if (!claimed[o] && domain_overlaps(&domain[d], &old[o]))
+				break;
+
+		if (o == nold) {
+#if !defined(__linux__)
+			domain_freqs(d);
+#endif
+			if ((err = domain_limits(d, minmhz, maxmhz, 1)) != NULL) {
+				fprintf(stderr, "estd: %s\n", err);
+				exit(1);
+			}
+			domstat_init(d);
+#if defined(__linux__)
+			linux_takeover_domain(&domain[d]);
+#endif
+			if ((governors[activegov]->init != NULL) &&
+			    (governors[activegov]->init(&domain[d]) != 0)) {
+				fprintf(stderr, "estd: Cannot initialize governor %s\n",
+				    governors[activegov]->name);
+				exit(1);
+			}
+			domain[d].curfreq = domain[d].minidx;
+			set_freq(d);
+			continue;
+		}
+
+		claimed[o] = d + 1;
+		mhz = old[o].freqtab[old[o].curfreq];
+		/* keep the old table unless the platform handed us a new one */
+		if (domain[d].freqtab == NULL) {
+			domain[d].freqtab = old[o].freqtab;
+			domain[d].freqtab2perf = old[o].freqtab2perf;
+			domain[d].nfreqs = old[o].nfreqs;
+		} else {
+			free(old[o].freqtab);
+			free(old[o].freqtab2perf);
+		}
+		if ((err = domain_limits(d, minmhz, maxmhz, 1)) != NULL) {
+			fprintf(stderr, "estd: %s\n", err);
+			exit(1);
+		}
+		if (domain[d].nfreqs == old[o].nfreqs) {
+			domstat[d] = oldstat[o];
+			/* the knob may not be the same one */
+			domstat[d].written = -1;
+#if !defined(__OpenBSD__) && !defined(__linux__)
+			domstat[d].setmiblen = 0;
+#endif
+		} else {
+			free(oldstat[o].residency);
+			free(oldstat[o].transitions);
+			domstat_init(d);
+		}
+
+		for (i = domain[d].minidx; (i < domain[d].maxidx) &&
+		    (domain[d].freqtab[i] < mhz); i++)
+			;
+		domain[d].curfreq = i;
+		domain[d].curcpu = old[o].curcpu;
+		domain[d].lowtime = old[o].lowtime;
+		memcpy(domain[d].loadhist, old[o].loadhist, sizeof(domain[d].loadhist));
+		domain[d].loadpos = old[o].loadpos;
+		domain[d].nloads = old[o].nloads;
+		domain[d].ewma = old[o].ewma;
+		domain[d].govdata = old[o].govdata;
+#if defined(__linux__)
+		domain[d].setfd = old[o].setfd;
+		memcpy(domain[d].oldgov, old[o].oldgov, sizeof(domain[d].oldgov));
+#endif
+		set_freq(d);
+	}
+
+	for (o = 0; o < nold; o++) {
+		if (claimed[o])
+			continue;
+		if (governors[activegov]->teardown != NULL)
+			governors[activegov]->teardown(&old[o]);
+#if defined(__linux__)
+		linux_release_domain(&old[o]);
+#endif
+		free(old[o].freqtab);
+		free(old[o].freqtab2perf);
+		free(oldstat[o].residency);
+		free(oldstat[o].transitions);
+	}
+	for (o = 0; o < nold; o++)
+		domain_free(&old[o]);
+#ifdef OVERHEAT_HACK
+	/*
+	 * -T n= and -c n= follow their domain to its new index; entries of
+	 * a domain that is gone are kept for the sensor thread, but unused
+	 */
+	for (i = 0; i < nsensors; i++) {
+		if ((o = sensors[i].domain) < 0)
+			continue;
+		if ((o < nold) && claimed[o]) {
+			sensors[i].domain = claimed[o] - 1;
+			continue;
+		}
+		fprintf(stderr, "estd: domain %d is gone, its sensor %s is no longer used\n",
+		    o, sensors[i].device);
+		sensors[i].domain = -2;
+	}
+#endif
+	/* leases on one domain follow it too, and end with it */
+	for (i = 0; i < LEASE_MAX; i++) {
+		if ((leases[i].id == 0) || ((o = leases[i].domain) < 0))
+			continue;
+		if ((o < nold) && claimed[o])
+			leases[i].domain = claimed[o] - 1;
+		else
+			leases[i].id = 0;
+	}
+	free(claimed);
+	free(oldstat);
+	free(old);
+
+	event_record(-1, ESTD_EVENT_TOPOLOGY, nold, ndomains);
+	if ((!daemonize) && (verbose))
+		printf("estd: cpus changed, now %d cpus in %d domains\n", ncpus, ndomains);
+}
+
+#ifdef OVERHEAT_HACK
+/* the entry for domain dom, added if there is none yet */
+struct sensor *
+sensor_entry(int dom)
+{
+	int i;
+
+	for (i = 0; i < nsensors; i++)
+		if (sensors[i].domain == dom)
+			return &sensors[i];
+	if ((sensors = realloc(sensors, (nsensors + 1) * sizeof(struct sensor))) == NULL) {
+		fprintf(stderr, "estd: realloc failed (errno %d)\n", errno);
+		exit(1);
+	}
+	memset(&sensors[nsensors], 0, sizeof(struct sensor));
+	sensors[nsensors].domain = dom;
+	sensors[nsensors].crit = -1;
+	return &sensors[nsensors++];
+}
+
+/*
+ * -T [domain=]pattern and -c [domain=]temperature. Without a domain they
+ * set the default for all domains that have no entry of their own.
+ */
+void
+sensor_option(int ch, char *arg)
+{
+	struct sensor *sn;
+	char *eq;
+	int dom = -1;
+
+	if (((eq = strchr(arg, '=')) != NULL) && (eq > arg) &&
+	    (strspn(arg, "0123456789") == (size_t)(eq - arg))) {
+		dom = atoi(arg);
+		arg = eq + 1;
+	}
+	if (dom == -1) {
+		if (ch == 'T')
+			sensordev = arg;
+		else
+			sensorcrit = atof(arg);
+		return;
+	}
+
+	sn = sensor_entry(dom);
+	if (ch == 'T')
+		sn->device = arg;
+	else
+		sn->crit = atof(arg);
+}
+
+/* fill in the defaults and add the entry for all other domains */
+void
+sensor_init(void)
+{
+	struct sensor *sn;
+	int i;
+
+	for (i = 0; i < nsensors; i++) {
+		if (sensors[i].domain >= ndomains) {
+			fprintf(stderr, "estd: No domain %d for -T or -c, there are %d\n",
+			    sensors[i].domain, ndomains);
+			exit(1);
+		}
+		if (sensors[i].device == NULL)
+			sensors[i].device = sensordev;
+		if (sensors[i].device == NULL) {
+			fprintf(stderr, "estd: No sensor pattern for domain %d\n",
+			    sensors[i].domain);
+			exit(1);
+		}
+		if (sensors[i].crit < 0)
+			sensors[i].crit = sensorcrit;
+	}
+	if (sensordev != NULL) {
+		sn = sensor_entry(-1);
+		sn->device = sensordev;
+		sn->crit = sensorcrit;
+	}
+}
+
+/* the sensor entry watching domain d, or NULL */
+struct sensor *
+domain_sensor(int d)
+{
+	struct sensor *def = NULL;
+	int i;
+
+	for (i = 0; i < nsensors; i++) {
+		if (sensors[i].domain == d)
+			return &sensors[i];
+		if (sensors[i].domain == -1)
+			def = &sensors[i];
+	}
+	return def;
+}
+
+/*
+ * add a reading taken at now (in s) and publish it. The trend is the least
+ * squares slope over the last SENSOR_HIST readings, single sensor steps are
+ * often a whole degree. Returns the ms until the next reading: sensorpoll
+ * while the projected temperature is far from the limit, shrinking down to
+ * SENSOR_MINPOLL as it gets close.
+ */
+unsigned int
+sensor_record(struct sensor *sn, double degrees, int hot, double now)
+{
+	double slope = 0, mt = 0, md = 0, num = 0, den = 0;
+	double span, frac;
+	unsigned int seq, ms;
+	int i;
+
+	ms = MAX(sensorpoll, 1) * 1000;
+	sn->hist_t[sn->pos] = now;
+	sn->hist_deg[sn->pos] = degrees;
+	sn->pos = (sn->pos + 1) % SENSOR_HIST;
+	sn->n = MIN(sn->n + 1, SENSOR_HIST);
+	for (i = 0; i < sn->n; i++) {
+		mt += sn->hist_t[i];
+		md += sn->hist_deg[i];
+	}
+	mt /= sn->n;
+	md /= sn->n;
+	for (i = 0; i < sn->n; i++) {
+		num += (sn->hist_t[i] - mt) * (sn->hist_deg[i] - md);
+		den += (sn->hist_t[i] - mt) * (sn->hist_t[i] - mt);
+	}
+	if (den > 0)
+		slope = num / den;
+
+	seq = atomic_load_explicit(&sn->seq, memory_order_relaxed);
+	atomic_store_explicit(&sn->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&sn->temp, (int64_t)(degrees * 1000),
+	    memory_order_relaxed);
+	atomic_store_explicit(&sn->slope, (int64_t)(slope * 1000),
+	    memory_order_relaxed);
+	atomic_store_explicit(&sn->hot, hot ? 1 : 0, memory_order_relaxed);
+	atomic_store_explicit(&sn->seq, seq + 2, memory_order_release);
+
+	span = 2 * ((thermband > 0) ? thermband : DEF_THERMBAND);
+	frac = (sn->crit - (degrees + MAX(slope, 0) * thermhorizon)) / span;
+	return MAX(SENSOR_MINPOLL, MIN(1.0, MAX(0.0, frac)) * ms);
+}
+
+/* read the sensors of an entry; errors keep the last reading */
+unsigned int
+sensor_sample(struct sensor *sn)
+{
+	struct timespec ts;
+	double degrees = 0;
+	int hot;
+
+	hot = check_overheat(sn->device, sn->crit, &degrees);
+	atomic_store_explicit(&sensorcalls, overheat_calls, memory_order_relaxed);
+	if (hot < 0)
+		return MAX(sensorpoll, 1) * 1000;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return sensor_record(sn, degrees, hot,
+	    ts.tv_sec + ts.tv_nsec / 1000000000.0);
+}
+
+/* read every sensor entry that is due, returns the us until the next one */
+int64_t
+sensor_due(void)
+{
+	struct timespec now;
+	int64_t left, next = INT64_MAX;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < nsensors; i++) {
+		if ((left = ts_diff(&sensors[i].next, &now)) <= 0) {
+			sensors[i].next = now;
+			ts_add(&sensors[i].next, sensor_sample(&sensors[i]) * 1000);
+			left = ts_diff(&sensors[i].next, &now);
+		}
+		next = MIN(next, left);
+	}
+	return next;
+}
+
+/*
+ * Reading the sensors can take tens of milliseconds (NetBSD runs envstat
+ * and parses its XML), so it happens here instead of in the main loop
+ */
+void *
+sensor_thread(void *arg)
+{
+	struct timespec ts;
+	int64_t us = (intptr_t)arg;
+
+	for (;;) {
+		ts.tv_sec = us / 1000000;
+		ts.tv_nsec = (us % 1000000) * 1000;
+		nanosleep(&ts, NULL);
+		atomic_fetch_add_explicit(&sensorwakeups, 1, memory_order_relaxed);
+		us = sensor_due();
+	}
+	return NULL;
+}
+
+void
+sensor_start(void)
+{
+	pthread_t thread;
+	sigset_t all, old;
+	int64_t us;
+
+	/* the first reading is synchronous, we don't want to start blind */
+	us = sensor_due();
+
+	/* signals are for the main loop, the thread starts with all blocked */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&thread, NULL, &sensor_thread, (void *)(intptr_t)us) != 0) {
+		fprintf(stderr, "estd: Cannot start sensor thread\n");
+		exit(1);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_detach(thread);
+}
+
+/* the latest reading of an entry and its trend in degC/s, never blocks */
+int
+sensor_read(struct sensor *sn, double *degrees, double *slope)
+{
+	unsigned int seq;
+	int64_t temp, dtemp;
+	int hot;
+
+	do {
+		seq = atomic_load_explicit(&sn->seq, memory_order_acquire);
+		temp = atomic_load_explicit(&sn->temp, memory_order_relaxed);
+		dtemp = atomic_load_explicit(&sn->slope, memory_order_relaxed);
+		hot = atomic_load_explicit(&sn->hot, memory_order_relaxed);
+		atomic_thread_fence(memory_order_acquire);
+	} while ((seq & 1) ||
+	    (seq != atomic_load_explicit(&sn->seq, memory_order_relaxed)));
+
+	*degrees = temp / 1000.0;
+	*slope = dtemp / 1000.0;
+	return hot;
+}
+
+/*
+ * Thermal cap: the highest frequency a domain may use falls linearly from
+ * its maximum at thermband degC below the critical temperature of its
+ * sensors to its minimum at the critical temperature. The temperature is
+ * extrapolated thermhorizon seconds ahead, so a steep rise is capped before
+ * it overshoots. A lower cap applies at once, a higher one is released one
+ * step per THERMAL_RELEASE. With -B 0, a domain is throttled all the way
+ * while its sensors are (or are projected to be) at the critical temperature.
+ * Domains without sensors are left alone.
+ */
+void
+thermal_update(useconds_t elapsed)
+{
+	struct sensor *sn;
+	double degrees, slope, pred, frac, mhz;
+	int d, lo, hi, idx, hot, oldidx;
+
+	sensorcur = 0;
+	sensorhot = 0;
+	for (d = 0; d < ndomains; d++) {
+		if ((sn = domain_sensor(d)) == NULL)
+			continue;
+		hot = sensor_read(sn, &degrees, &slope);
+		pred = degrees + slope * thermhorizon;
+		domstat[d].sensed = 1;
+		domstat[d].degrees = degrees;
+		sensorcur = MAX(sensorcur, degrees);
+		sensorhot |= hot;
+		if (thermband <= 0) {
+			domstat[d].hot = hot || (pred >= sn->crit);
+			continue;
+		}
+
+		frac = MAX(0.0, MIN(1.0, (sn->crit - pred) / thermband));
+		lo = domain[d].freqtab[domain[d].minidx];
+		hi = domain[d].freqtab[domain[d].maxidx];
+		mhz = lo + frac * (hi - lo);
+		for (idx = domain[d].maxidx; (idx > domain[d].minidx) &&
+		    (domain[d].freqtab[idx] > mhz); idx--)
+			;
+
+		if (domstat[d].thermidx > domain[d].maxidx)
+			domstat[d].thermidx = domain[d].maxidx;
+		oldidx = domstat[d].thermidx;
+		if (idx < domstat[d].thermidx) {
+			domstat[d].thermidx = idx;
+			domstat[d].thermtime = 0;
+		} else if (idx > domstat[d].thermidx) {
+			domstat[d].thermtime += elapsed;
+			if (domstat[d].thermtime >= THERMAL_RELEASE) {
+				domstat[d].thermidx++;
+				domstat[d].thermtime = 0;
+			}
+		} else
+			domstat[d].thermtime = 0;
+		if (domstat[d].thermidx != oldidx)
+			event_record(d, ESTD_EVENT_CAP, oldidx, domstat[d].thermidx);
+
+		if ((!daemonize) && (verbose) && (domstat[d].thermidx < domain[d].maxidx))
+			printf("estd: thermal cap(%d) %d MHz at %.1f degC\n", d,
+			    domain[d].freqtab[domstat[d].thermidx], degrees);
+	}
+}
+#endif
+
+/*
+ * Mock backend (-N): instead of the hardware, a scenario file describes the
+ * cpus, their frequencies and the load and temperature over time:
+ *
+ *	cpus 4
+ *	domains 2			# the cpus are split evenly
+ *	freqs 800 1600 2400
+ *	# seconds shape args [temp from [to]]
+ *	5	const 5
+ *	10	ramp 5 100
+ *	20	square 5 100 2 25	# low high period(s) duty(%)
+ *	20	saw 0 100 4		# from to period(s)
+ *	30	const 100 temp 60 95
+ *
+ * The load is the demand in percent of a domain running at its highest
+ * frequency, so the same demand keeps a slower domain busier. A temperature
+ * is fed to every sensor entry (all domains without -T) and ramps linearly
+ * over the segment; segments without one keep the last. The scenario runs
+ * on a simulated clock through the same update_domains() as the daemon, as
+ * fast as possible; frequency writes are only recorded.
+ */
+enum {
+	SHAPE_CONST = 0,
+	SHAPE_RAMP,
+	SHAPE_SQUARE,
+	SHAPE_SAW
+};
+
+struct segment {
+	u_int64_t	length;		/* us */
+	int		shape;
+	double		from;
+	double		to;
+	u_int64_t	period;		/* us */
+	double		duty;		/* percent of the period at to */
+	double		tfrom;		/* degC, -1 to keep the last one */
+	double		tto;
+};
+
+static struct segment *segments;
+static int      nsegments;
+
+/* read the scenario and set up ncpus and the domains from it */
+void
+mock_load(const char *file)
+{
+	static const char *shapes[] = { "const", "ramp", "square", "saw" };
+	static const int nargs[] = { 1, 2, 4, 3 };
+	FILE *fh;
+	char line[256], *p, *argv[10];
+	struct segment *seg;
+	int *freqs = NULL, nfreqs = 0, ndoms = 1, lineno = 0, argc, i, d;
+
+	if ((fh = fopen(file, "r")) == NULL) {
+		fprintf(stderr, "estd: Cannot open scenario %s: %s\n", file, strerror(errno));
+		exit(1);
+	}
+	ncpus = 1;
+	while (fgets(line, sizeof(line), fh) != NULL) {
+		lineno++;
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		p = line + strspn(line, " \t\n");
+		if (*p == '\0')
+			continue;
+		if (strncmp(p, "freqs", 5) == 0) {
+			free(freqs);
+			nfreqs = parse_freqs(p + 5, &freqs);
+			continue;
+		}
+
+		for (argc = 0, p = strtok(p, " \t\n"); (p != NULL) && (argc < 10);
+		    p = strtok(NULL, " \t\n"))
+			argv[argc++] = p;
+		if ((argc == 2) && (strcmp(argv[0], "cpus") == 0)) {
+			ncpus = atoi(argv[1]);
+			continue;
+		}
+		if ((argc == 2) && (strcmp(argv[0], "domains") == 0)) {
+			ndoms = atoi(argv[1]);
+			continue;
+		}
+
+		for (i = 0; (argc >= 2) && (i < 4) && (strcmp(argv[1], shapes[i]) != 0); i++)
+			;
+		if ((argc < 2) || (i == 4) || (atof(argv[0]) <= 0) ||
+		    ((argc != 2 + nargs[i]) && (argc != 4 + nargs[i]) &&
+		    (argc != 5 + nargs[i])) ||
+		    ((argc > 2 + nargs[i]) && (strcmp(argv[2 + nargs[i]], "temp") != 0))) {
+			fprintf(stderr, "estd: %s:%d: Invalid scenario line\n", file, lineno);
+			exit(1);
+		}
+		if ((segments = realloc(segments, (nsegments + 1) * sizeof(struct segment))) == NULL) {
+			fprintf(stderr, "estd: realloc failed (errno %d)\n", errno);
+			exit(1);
+		}
+		seg = &segments[nsegments++];
+		memset(seg, 0, sizeof(*seg));
+		seg->length = atof(argv[0]) * 1000000;
+		seg->shape = i;
+		seg->from = seg->to = atof(argv[2]);
+		if (nargs[i] > 1)
+			seg->to = atof(argv[3]);
+		if (nargs[i] > 2)
+			seg->period = MAX(atof(argv[4]) * 1000000, 1000);
+		seg->duty = (nargs[i] > 3) ? atof(argv[5]) : 0;
+		seg->tfrom = seg->tto = -1;
+		if (argc > 2 + nargs[i])
+			seg->tfrom = seg->tto = atof(argv[3 + nargs[i]]);
+		if (argc > 4 + nargs[i])
+			seg->tto = atof(argv[4 + nargs[i]]);
+	}
+	fclose(fh);
+
+	if ((ncpus < 1) || (ndoms < 1) || (ndoms > ncpus) || (nfreqs < 1) ||
+	    (nsegments == 0)) {
+		fprintf(stderr, "estd: %s needs cpus, domains, freqs and some load\n", file);
+		exit(1);
+	}
+	qsort(freqs, nfreqs, sizeof(int), freqcmp);
+
+	ndomains = ndoms;
+	domain = ecalloc(ndomains, sizeof(struct domain));
+	for (d = 0; d < ndomains; d++) {
+		domain[d].cpus = ecalloc(ncpus, sizeof(int));
+		domain[d].nfreqs = nfreqs;
+		domain[d].freqtab = ecalloc(nfreqs, sizeof(int));
+		domain[d].freqtab2perf = ecalloc(nfreqs, sizeof(int));
+		memcpy(domain[d].freqtab, freqs, nfreqs * sizeof(int));
+		memcpy(domain[d].freqtab2perf, freqs, nfreqs * sizeof(int));
+	}
+	for (i = 0; i < ncpus; i++) {
+		d = i * ndomains / ncpus;
+		domain[d].cpus[domain[d].ncpus++] = i;
+	}
+	free(freqs);
+}
+
+/* the demand t us into the scenario, -1 past its end; updates *temp */
+double
+mock_demand(u_int64_t t, double *temp)
+{
+	struct segment *seg;
+	double frac;
+	int i;
+
+	for (i = 0; (i < nsegments) && (t >= segments[i].length); i++)
+		t -= segments[i].length;
+	if (i == nsegments)
+		return -1;
+
+	seg = &segments[i];
+	frac = (double)t / seg->length;
+	if (seg->tfrom >= 0)
+		*temp = seg->tfrom + (seg->tto - seg->tfrom) * frac;
+	switch (seg->shape) {
+	case SHAPE_RAMP:
+		return seg->from + (seg->to - seg->from) * frac;
+	case SHAPE_SQUARE:
+		return ((t % seg->period) * 100.0 < seg->duty * seg->period) ?
+		    seg->to : seg->from;
+	case SHAPE_SAW:
+		return seg->from + (seg->to - seg->from) *
+		    (t % seg->period) / seg->period;
+	default:
+		return seg->from;
+	}
+}
+
+/*
+ * Run a scenario and report per domain the transitions per minute, the time
+ * from load above the high watermark to the highest frequency, and an energy
+ * proxy: dynamic power grows with f * V^2 and V roughly with f, so it is the
+ * busy time weighted by (f / fmax)^3, in cpu seconds at full speed.
+ */
+int
+mock_run(const char *file)
+{
+	struct replaystat *st;
+	const char *err;
+	u_int64_t *ticks, busy, t, v, total = 0;
+	useconds_t poll = pollint;
+	double demand, sum, temp = -1, util, f;
+	int cpu, d, i, steps, npolls = 0, idle, moving;
+#ifdef OVERHEAT_HACK
+	struct sensor *sn;
+#endif
+
+	mock_load(file);
+	cp_alloc();
+	ticks = ecalloc(ncpus * TRACE_STATES, sizeof(u_int64_t));
+	st = ecalloc(ndomains, sizeof(struct replaystat));
+	domstat_alloc();
+	for (d = 0; d < ndomains; d++) {
+		st[d].time = ecalloc(domain[d].nfreqs, sizeof(u_int64_t));
+		if ((err = domain_limits(d, minmhz, maxmhz, 1)) != NULL) {
+			fprintf(stderr, "estd: %s\n", err);
+			exit(1);
+		}
+		domain[d].curfreq = domain[d].minidx;
+	}
+#ifdef OVERHEAT_HACK
+	sensor_init();
+	if (nsensors == 0) {
+		sn = sensor_entry(-1);
+		sn->device = "mock";
+		sn->crit = sensorcrit;
+	}
+#endif
+
+	for (;;) {
+		/* mean demand over the coming poll, in 1 ms steps */
+		for (sum = 0, steps = 0, t = mocknow; t < mocknow + poll; t += 1000, steps++) {
+			if ((demand = mock_demand(t, &temp)) < 0)
+				break;
+			sum += demand;
+		}
+		if (steps == 0)
+			break;
+		v = MIN(poll, steps * 1000);
+		demand = sum / steps;
+		mocknow += v;
+		evclock += v;
+
+		cp_save();
+		for (d = 0; d < ndomains; d++) {
+			f = (double)domain[d].freqtab[domain[d].curfreq] /
+			    domain[d].freqtab[domain[d].nfreqs - 1];
+			util = MAX(0.0, MIN(100.0, demand / f));
+			busy = v * util / 100;
+			for (i = 0; i < domain[d].ncpus; i++) {
+				cpu = domain[d].cpus[i];
+				ticks[cpu * TRACE_STATES] += busy;
+				ticks[cpu * TRACE_STATES + 4] += v - busy;
+				cp_import(cpu, &ticks[cpu * TRACE_STATES]);
+			}
+			st[d].energy += busy / 1000000.0 * domain[d].ncpus * f * f * f;
+		}
+#ifdef OVERHEAT_HACK
+		if (temp >= 0) {
+			for (i = 0; i < nsensors; i++)
+				sensor_record(&sensors[i], temp, temp >= sensors[i].crit,
+				    mocknow / 1000000.0);
+			thermal_update(v);
+		}
+#endif
+
+		replaystat_before(st, v);
+		update_domains(0, v, &idle, &moving);
+		npolls++;
+		total += v;
+		replaystat_after(st);
+		if (maxpoll > 0)
+			poll = next_poll(poll, idle, moving);
+	}
+
+	printf("estd: %s with %s: %d polls covering %.1f s, %llu frequency and %llu clockmod writes (%llu skipped)\n",
+	    file, governors[activegov]->name, npolls, total / 1000000.0,
+	    (unsigned long long)freqwrites, (unsigned long long)clockmodwrites,
+	    (unsigned long long)(freqskipped + clockmodskipped));
+	for (d = 0; d < ndomains; d++) {
+		printf("Domain %d: %d transitions (%.1f/min)", d, st[d].transitions,
+		    total ? st[d].transitions * 60000000.0 / total : 0.0);
+		replaystat_print(&st[d]);
+		printf(", energy %.2f\n", st[d].energy);
+		for (i = 0; (total > 0) && (i < domain[d].nfreqs); i++)
+			printf("%6i MHz %5.1f%%\n", domain[d].freqtab[i],
+			    st[d].time[i] * 100.0 / total);
+	}
+
+	if (metricsfile != NULL)
+		metrics_write(metricsfile);
+	for (d = 0; (activegov != -1) && (d < ndomains); d++)
+		if (governors[activegov]->teardown != NULL)
+			governors[activegov]->teardown(&domain[d]);
+	if ((eventfile != NULL) && (event_dump(eventfile) < 0))
+		fprintf(stderr, "estd: Cannot write %s: %s\n", eventfile, strerror(errno));
+
+	return 0;
+}
+
+/* clean up the pidfile and clockmod on exit */
+void
+sighandler(int sig)
+{
+	set_clockmod(clockmod_max);
+#ifdef __OpenBSD__
+	{
+		int hw_perfpolicy[] = {CTL_HW, HW_PERFPOLICY};
+		sysctl(hw_perfpolicy, 2, NULL, NULL, "auto", sizeof("auto") - 1);
+	}
+#endif
+#ifdef __linux__
+	linux_release();
+	pidfile_remove(pdf);
+#endif
+	if (ctlpath != NULL)
+		unlink(ctlpath);
+	if (statusfile != NULL)
+		unlink(statusfile);
+	if (eventfile != NULL)
+		event_dump(eventfile);
+	exit(0);
+}
+
+/* dump the event ring on SIGHUP or SIGINFO, from the main loop */
+void
+sigdumphandler(int sig)
+{
+	dumpevents = 1;
+	wakeup = 1;
+}
+
+/* switch strategy on SIGUSR{1,2} */
+void
+sigusrhandler(int sig)
+{
+	switch (sig) {
+		case SIGUSR1:
+				if (strategy>BATTERY && strategy<=AGGRESSIVE) strategy--;
+				break;
+		case SIGUSR2:
+				if (strategy<AGGRESSIVE) strategy++;
+				break;
+	}
+	wakeup = 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int             ch;
+	int             i;
+#if !defined(__OpenBSD__) && !defined(__linux__)
+	char            frequencies[SYSCTLBUF];	/* XXX Ugly */
+	size_t          freqsize = SYSCTLBUF;
+#endif
+	int             d;
+	FILE           *fexists;
+	const char     *err;
+	char procbuf[1024];
+	size_t proclen;
+	useconds_t      curpoll = pollint;
+	useconds_t      elapsed;
+	u_int64_t       metricstime = 0;
+	u_int64_t       ovhtime = 0;
+	struct timespec ts_work;
+	u_int64_t       topotime = 0;
+	int64_t         late;
+	struct timespec ts_last, ts_now, deadline;
+	int             idle, moving;
+
+#ifdef __linux__
+	{
+		extern char **environ;
+		setproctitle_init(argc, argv, environ);
+	}
+#endif
 
 	/* get command-line options */
 #ifdef OVERHEAT_HACK
-	while ((ch = getopt(argc, argv, "vfdonACEGILPT:t:asbp:h:l:g:m:M:c:")) != -1)
+	while ((ch = getopt(argc, argv, "vfdonqACEGILPT:t:B:z:asS:bp:i:h:l:u:K:e:k:F:Q:j:D:g:m:M:c:w:r:N:")) != -1)
 #else
-	while ((ch = getopt(argc, argv, "vfdonACEGILPasbp:h:l:g:m:M:")) != -1)
+	while ((ch = getopt(argc, argv, "vfdonqACEGILPasS:bp:i:h:l:u:K:e:k:F:Q:j:D:g:m:M:w:r:N:")) != -1)
 #endif
 		switch (ch) {
 		case 'v':
@@ -527,8 +3827,14 @@ main(int argc, char *argv[])
 		case 'b':
 			strategy = BATTERY;
 			break;
+		case 'S':
+			govname = optarg;
+			break;
 		case 'p':
-			poll = atoi(optarg);
+			pollint = atoi(optarg);
+			break;
+		case 'i':
+			maxpoll = atoi(optarg);
 			break;
 		case 'h':
 			high = atoi(optarg);
@@ -536,6 +3842,38 @@ main(int argc, char *argv[])
 		case 'l':
 			low = atoi(optarg);
 			break;
+		case 'u':
+			target = atoi(optarg);
+			break;
+		case 'e':
+			parse_estimators(optarg);
+			break;
+		case 'k':
+			ctlpath = optarg;
+			break;
+#if defined(__linux__)
+		case 'D':
+			sysfsroot = optarg;
+			break;
+#endif
+		case 'F':
+			metricsfile = optarg;
+			break;
+		case 'Q':
+			statusfile = optarg;
+			break;
+		case 'j':
+			eventfile = optarg;
+			break;
+		case 'q':
+			proctitle = 0;
+			break;
+		case 'K':
+			if (sscanf(optarg, "%lf,%lf,%lf", &pid_kp, &pid_ki, &pid_kd) != 3) {
+				fprintf(stderr, "estd: -K expects kp,ki,kd\n");
+				exit(1);
+			}
+			break;
 		case 'g':
 			lowgrace = atoi(optarg);
 			break;
@@ -545,15 +3883,32 @@ main(int argc, char *argv[])
 		case 'M':
 			maxmhz = atoi(optarg);
 			break;
+		case 'w':
+			recordfile = optarg;
+			break;
+		case 'r':
+			replayfile = optarg;
+			break;
+		case 'N':
+			mockfile = optarg;
+			break;
 #ifdef OVERHEAT_HACK
 		case 'T':
-			sensordev = optarg;
+		case 'c':
+			sensor_option(ch, optarg);
 			break;
 		case 't':
 			sensorpoll = atoi(optarg);
 			break;
-		case 'c':
-			sensorcrit = atof(optarg);
+		case 'z':
+			thermhorizon = atoi(optarg);
+			break;
+		case 'B':
+			thermband = atof(optarg);
+			if (thermband < 0) {
+				fprintf(stderr, "estd: Invalid thermal band %s\n", optarg);
+				exit(1);
+			}
 			break;
 #endif
 		default:
@@ -561,34 +3916,25 @@ main(int argc, char *argv[])
 			/* NOTREACHED */
 		}
 
-	ndomains = 1;
-	domain = ecalloc(ndomains, sizeof(struct domain));
+	if (govname != NULL)
+		strategy = governor_find(govname);
 
-#if defined(__DragonFly__)
-	if (kinfo_get_cpus(&ncpus)) {
+	/* trace replay and the mock backend never touch the hardware */
+	if (replayfile != NULL)
+		return replay(replayfile);
+	if (mockfile != NULL)
+		return mock_run(mockfile);
+
+	if ((ncpus = get_ncpus()) < 0) {
 		fprintf(stderr, "estd: Cannot get number of cpus\n");
 		exit(1);
 	}
-	cp_time = ecalloc(ncpus, sizeof(struct kinfo_cputime));
-	cp_old  = ecalloc(ncpus, sizeof(struct kinfo_cputime));
-	cp_time_len = ncpus * sizeof(struct kinfo_cputime);
-#elif defined(__NetBSD__) || defined(__OpenBSD__)
-	{
-		size_t ncpus_len = sizeof(ncpus);
-		int ncpumib[] = {CTL_HW, HW_NCPU};
-		if (sysctl(ncpumib, 2, &ncpus, &ncpus_len, NULL, 0) < 0) {
-			fprintf(stderr, "estd: Cannot get number of cpus\n");
-			exit(1);
-		}
-	}
-#endif
-	domain[0].ncpus = ncpus;
-	domain[0].cpus = ecalloc(ncpus, sizeof(int));
-	for (i = 0; i < domain[0].ncpus; i++)
-		domain[0].cpus[i] = i;
+	cp_alloc();
 
-#ifdef __OpenBSD__
+#if defined(__OpenBSD__)
 	tech = TECH_OPENBSD;
+#elif defined(__linux__)
+	tech = TECH_LINUX;
 #else
 	/* try to guess cpu-scaling technology */
 	if (tech == TECH_UNKNOWN) {
@@ -600,111 +3946,41 @@ main(int argc, char *argv[])
 			exit(1);
 		}
 	}
-
-	if (tech == TECH_ACPI) {
-		if (acpi_init()) {
-			fprintf(stderr, "estd: Cannot ACPI P-States\n");
-			exit(1);
-		}
-	} else {
-		domain[0].freqctl = freqctl[tech];
-		domain[0].setctl = setctl[tech];
-	}
 #endif
-	if ((high <= low) || (low < 0) || (low > 100) || (high < 0) || (high > 100)) {
+	domains_init();
+
+	if (!valid_watermarks(high, low)) {
 		fprintf(stderr, "estd: Invalid high/low watermark combination\n");
 		exit(1);
 	}
 
-	if (poll < MIN_POLL) {
+	if ((target < 1) || (target > 100)) {
+		fprintf(stderr, "estd: Invalid target utilization\n");
+		exit(1);
+	}
+
+	if (pollint < MIN_POLL) {
 		fprintf(stderr, "estd: Poll interval is too low (minimum %i)\n", MIN_POLL);
 		exit(1);
 	}
 
+	if ((maxpoll > 0) && (maxpoll < pollint)) {
+		fprintf(stderr, "estd: Maximum poll interval is lower than the poll interval\n");
+		exit(1);
+	}
+
 	if (minmhz > maxmhz) {
 		fprintf(stderr, "estd: Invalid minimum/maximum MHz combination\n");
 		exit(1);
 	}
 
-#ifdef __OpenBSD__
-	{
-		int hw_perfpolicy[] = {CTL_HW, HW_PERFPOLICY};
-		int hw_setperf[] = {CTL_HW, HW_SETPERF};
-		int hw_cpuspeed[] = {CTL_HW, HW_CPUSPEED};
-		int idx, val;
-		int cpuclock;
-		size_t val_size = sizeof(val);
-
-		if (sysctl(hw_perfpolicy, 2, NULL, NULL,
-		    "manual", sizeof("manual") - 1) < 0) {
-			fprintf(stderr, "estd: sysctl: hw.perfpolicy: %s",
-			    strerror(errno));
-			exit(1);
-		}
-
-		idx = 0;
-		cpuclock = -1;
-		for (i = 0; i <= 100; i += 2) {
-			val = i;
-			if (sysctl(hw_setperf, 2, NULL, NULL,
-			    &val, sizeof(val)) < 0) {
-				fprintf(stderr, "estd: sysctl: hw.setperf: %s",
-				    strerror(errno));
-				exit(1);
-			}
-
-			if (sysctl(hw_cpuspeed, 2, &val, &val_size,
-			    NULL, 0) < 0) {
-				fprintf(stderr, "estd: sysctl: hw.cpuspeed: %s",
-				    strerror(errno));
-				exit(1);
-			}
-
-			if (cpuclock != val) {
-				cpuclock = val;
-				domain[0].freqtab[idx] = cpuclock;
-				domain[0].freqtab2perf[idx] = i;
-				if (++idx >= MAX_FREQS)
-					break;
-			}
-		}
-		domain[0].minidx = 0;
-		domain[0].maxidx = idx - 1;
-		domain[0].nfreqs = idx;
-	}
-#else
 	/* for each cpu domain... */
 	for (d = 0; d < ndomains; d++) {
-		/* get supported frequencies... */
-		if (sysctlbyname(domain[d].freqctl, &frequencies, &freqsize, NULL, 0) < 0) {
-			fprintf(stderr, "estd: Cannot get supported frequencies (maybe you forced the wrong CPU-scaling technology?)\n");
-			exit(1);
-		}
-		fp = &frequencies[0];
-		while ((domain[d].nfreqs < MAX_FREQS) && ((domain[d].freqtab[domain[d].nfreqs++] = strtol(fp, &fp, 10)) != 0));
-		domain[d].nfreqs--;
-		if (domain[d].nfreqs <= 0) {
-			fprintf(stderr, "estd: No supported frequencies found?! (please report this error)\n");
-			exit(1);
-		}
-		/* ...and sort them in ascending order */
-		qsort(&domain[d].freqtab, domain[d].nfreqs, sizeof(domain[d].freqtab[0]), &freqcmp);
-		/* some sanity checks */
-		while ((domain[d].minidx < domain[d].nfreqs) && (domain[d].freqtab[domain[d].minidx] < minmhz))
-			domain[d].minidx++;
-		if (domain[d].minidx >= domain[d].nfreqs) {
-			fprintf(stderr, "estd: Minimum Frequency is too high\n");
-			exit(1);
-		}
-		domain[d].maxidx = domain[d].nfreqs - 1;
-		while ((domain[d].maxidx > -1) && (domain[d].freqtab[domain[d].maxidx] > maxmhz))
-		domain[d].maxidx--;
-		if (domain[d].maxidx < 0) {
-			fprintf(stderr, "estd: Maximum Frequency is too low\n");
-			exit(1);
-		}
-		if (domain[d].freqtab[domain[d].minidx] > domain[d].freqtab[domain[d].maxidx]) {
-			fprintf(stderr, "estd: No supported frequency within given range found\n");
+#if !defined(__linux__)
+		domain_freqs(d);
+#endif
+		if ((err = domain_limits(d, minmhz, maxmhz, 1)) != NULL) {
+			fprintf(stderr, "estd: %s\n", err);
 			exit(1);
 		}
 	}
@@ -719,11 +3995,10 @@ main(int argc, char *argv[])
 		}
 		exit(0);
 	}
-#endif
 
 #ifdef __NetBSD__
 	{
-		char   *lastfp = NULL;
+		char   *fp, *lastfp = NULL;
 		char	clockmods[SYSCTLBUF];
 		size_t	len = sizeof(clockmods);
 
@@ -759,7 +4034,7 @@ main(int argc, char *argv[])
 		printf("estd: Not detaching from terminal\n");
 	}
 
-#if defined(__DragonFly__)
+#if defined(__DragonFly__) || defined(__linux__)
 	pdf = pidfile_open(NULL, 600, NULL);
 	if (pdf == NULL) {
 		fprintf(stderr, "estd: Cannot write pidfile (maybe you aren't root?)\n");
@@ -775,88 +4050,149 @@ main(int argc, char *argv[])
 #endif
 	
 	/* init some vars and set inital frequency */
-	signal(SIGHUP, SIG_IGN);
+	if (eventfile != NULL) {
+		signal(SIGHUP, &sigdumphandler);
+#ifdef SIGINFO
+		signal(SIGINFO, &sigdumphandler);
+#endif
+	} else
+		signal(SIGHUP, SIG_IGN);
 	signal(SIGINT, &sighandler);
 	signal(SIGPIPE, &sighandler);
 	signal(SIGTERM, &sighandler);
 	signal(SIGUSR1, &sigusrhandler);
 	signal(SIGUSR2, &sigusrhandler);
 
+#ifdef __linux__
+	linux_takeover();
+#endif
+	if (recordfile != NULL)
+		trace_open(recordfile);
+	if (ctlpath != NULL)
+		ctl_open(ctlpath);
+	if (statusfile != NULL)
+		status_open(statusfile);
+	domstat_alloc();
+#ifdef OVERHEAT_HACK
+	sensor_init();
+	if (nsensors > 0)
+		sensor_start();
+#endif
+
 	for (d = 0; d < ndomains; d++) {
 		domain[d].curfreq = domain[d].minidx;
 		set_freq(d);
 	}
 	set_clockmod(clockmod_min);
+	curpoll = pollint;
+	clock_gettime(CLOCK_MONOTONIC, &ts_last);
+	deadline = ts_last;
+	ovh.wincpu = cpu_used();
 
 	/* the big processing loop, we will only exit via signal */
 	while (1) {
-#ifdef OVERHEAT_HACK
-		int overheating = is_overheat(sensordev, sensorcrit, sensorpoll, &sensorcur);
-#endif
+		int overheating = 0;	/* per domain, from thermal_update */
+
+		clock_gettime(CLOCK_MONOTONIC, &ts_work);
 		get_cputime();
 
-		proclen = 0;
-		procbuf[0] = '\0';
-		for (d = 0; d < ndomains; d++) {
-			domain[d].curcpu = get_cpuusage(d);
-			if ((!daemonize) && (verbose))
-				printf("estd: load(%d) %d\n", d, domain[d].curcpu);
-			if (domain[d].curcpu != -1) {
-				/* strategy can change anytime (SIGUSR) */ 
-				curstrat = strategy;
+		/* the grace period counts real time, not poll intervals */
+		clock_gettime(CLOCK_MONOTONIC, &ts_now);
+		elapsed = (ts_now.tv_sec - ts_last.tv_sec) * 1000000 +
+		    (ts_now.tv_nsec - ts_last.tv_nsec) / 1000;
+		ts_last = ts_now;
+		evclock += elapsed;
 #ifdef OVERHEAT_HACK
-				if (overheating) {
-					if ((!daemonize) && (verbose))
-						printf("estd: overheat\n");
-				}
+		if (nsensors > 0) {
+			thermal_update(elapsed);
+			for (d = 0; d < ndomains; d++)
+				overheating |= domstat[d].hot;
+		}
 #endif
-				if ((domain[d].curfreq > domain[d].minidx) && (overheating || (domain[d].curcpu < low))) {
-					if (domain[d].lowtime < lowgrace)
-						domain[d].lowtime += poll;
-
-					if (domain[d].lowtime >= lowgrace) {
-						if (curstrat == BATTERY)
-							domain[d].curfreq = domain[d].minidx;
-						else
-							domain[d].curfreq--;
-						set_freq(d);
-						if (domain[d].curfreq == domain[d].minidx)
-							set_clockmod(clockmod_min);
-					}
-				} else {
-					domain[d].lowtime = 0;
-
-					if ((domain[d].curfreq < domain[d].maxidx) && (!overheating && (domain[d].curcpu > high))) {
-						if (curstrat == AGGRESSIVE)
-							domain[d].curfreq = domain[d].maxidx;
-						else
-							domain[d].curfreq++;
-						set_freq(d);
-						if (domain[d].curfreq != domain[d].minidx)
-							set_clockmod(clockmod_max);
-					}
-				}
 
-				proclen += snprintf(procbuf + proclen, sizeof(procbuf) - 1 - proclen,
-				    "%s%d%%%%,%dMHz",
-				    (d == 0) ? "" : ",",
-				    domain[d].curcpu, 
-					domain[d].freqtab[domain[d].curfreq]);
+		if (ctlfd >= 0)
+			lease_apply();
+		update_domains(0, elapsed, &idle, &moving);
+		if (tracefh != NULL)
+			trace_write(elapsed, overheating);
+		if (metricsfile != NULL) {
+			metricstime += elapsed;
+			if (metricstime >= METRICS_INTERVAL) {
+				metrics_write(metricsfile);
+				metricstime = 0;
 			}
 		}
+		ovhtime += elapsed;
+		if (ovhtime >= OVERHEAD_INTERVAL) {
+			overhead_summary(ovhtime);
+			ovhtime = 0;
+		}
+		topotime += elapsed;
+		if (topochanged || (topotime >= TOPOLOGY_INTERVAL)) {
+			topotime = 0;
+			if (topology_changed())
+				topology_rebuild();
+		}
 
+		if (status != NULL)
+			status_update(&ts_now);
+		if (dumpevents) {
+			dumpevents = 0;
+			if ((event_dump(eventfile) < 0) && (!daemonize))
+				fprintf(stderr, "estd: Cannot write %s: %s\n", eventfile, strerror(errno));
+		}
+
+		if (proctitle) {
+			proclen = 0;
+			procbuf[0] = '\0';
+			for (d = 0; d < ndomains; d++) {
+				if (domain[d].curcpu != -1)
+					proclen += snprintf(procbuf + proclen, sizeof(procbuf) - 1 - proclen,
+					    "%s%d%%%%,%dMHz",
+					    (d == 0) ? "" : ",",
+					    domain[d].curcpu, 
+						domain[d].freqtab[domain[d].curfreq]);
+			}
 
 #ifdef OVERHEAT_HACK
-		proclen += snprintf(procbuf + proclen, sizeof(procbuf) - 1 - proclen, ", %.1fdegC%s",
-		    sensorcur, overheating ? " (Overheated)" : "");
+			proclen += snprintf(procbuf + proclen, sizeof(procbuf) - 1 - proclen, ", %.1fdegC%s",
+			    sensorcur, sensorhot ? " (Overheated)" : "");
 #endif
-		setproctitle(procbuf);
+			setproctitle(procbuf);
+		}
 
 
 
-		if (poll >= 1000000)
-			sleep(poll / 1000000);
-		usleep(poll % 1000000);
+		/*
+		 * polls sit on a fixed grid of absolute deadlines, so the time
+		 * spent working doesn't add up to drift. Fall back onto the grid
+		 * if we overran a whole interval; an early wakeup from the control
+		 * socket or a signal is not a new grid point and leaves the
+		 * adaptive interval alone.
+		 */
+		clock_gettime(CLOCK_MONOTONIC, &ts_now);
+		overhead_poll(ts_diff(&ts_now, &ts_work));
+		if (ts_diff(&deadline, &ts_now) <= 0) {
+			if (maxpoll > 0) {
+				curpoll = next_poll(curpoll, idle, moving);
+				if ((!daemonize) && (verbose))
+					printf("estd: poll %u us\n", (unsigned int)curpoll);
+			}
+			ts_add(&deadline, curpoll);
+			if (ts_diff(&deadline, &ts_now) <= 0) {
+				overruns++;
+				deadline = ts_now;
+				ts_add(&deadline, curpoll);
+			}
+		}
+		if (ctl_wait(&deadline) == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &ts_now);
+			late = ts_diff(&ts_now, &deadline);
+			for (i = 0; (i < JITTER_BUCKETS - 1) && (late > (10 << (2 * i))); i++)
+				;
+			jitterhist[i]++;
+			jittersum += late;
+		}
 	}
 
 	return 0;
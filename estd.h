@@ -0,0 +1,195 @@
+/*
+ * estd governor interface. Code (c) 2004-2007 by Ove Soerensen, Portions (c)
+ * 2006,2009 Johannes Hofmann, 2007 Stephen M. Rumble
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met: 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer. 2.
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS 'AS IS' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE   FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * A governor picks the next frequency of a domain from its load. estd ships
+ * battery, smooth, aggressive, capacity and pid; more can be loaded from a
+ * shared object with -S /path/to/governor.so, which must export
+ *
+ *	struct governor estd_governor = {
+ *		ESTD_GOVERNOR_VERSION, "name", init, decide, teardown
+ *	};
+ *
+ * init and teardown may be NULL. Plugins are built against this header with
+ * the same compiler flags as estd, e.g. cc -shared -fPIC -o gov.so gov.c
+ */
+
+#ifndef _ESTD_H_
+#define _ESTD_H_
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#define ESTD_GOVERNOR_VERSION 3
+
+#define LOAD_HIST 16	/* recent load samples kept per domain */
+
+#if defined(__DragonFly__)
+ #define useconds_t unsigned int
+#endif
+
+/* a domain is a set of CPUs for which the frequency must be set together */
+struct domain {
+	int         *cpus;
+	int          ncpus;
+	char        *freqctl;
+	char        *setctl;
+	useconds_t   lowtime;
+	int         *freqtab;	/* MHz, ascending, nfreqs entries */
+	int         *freqtab2perf;
+	int          nfreqs;
+	int          minidx;
+	int          maxidx;
+	int          curcpu;
+	int          curfreq;
+	int          loadhist[LOAD_HIST];	/* ring buffer of curcpu */
+	int          loadpos;
+	int          nloads;
+	double       ewma;
+	void        *govdata;	/* private to the active governor */
+#if defined(__linux__)
+	char        *govctl;
+	char         oldgov[32];
+	int          setfd;
+#endif
+};
+
+/* what a governor gets to see of one poll */
+struct sample {
+	int          load;		/* percent, busiest cpu of the domain */
+	int          up;		/* load estimate to decide on speeding up */
+	int          down;		/* load estimate to decide on slowing down */
+	int          overheating;
+};
+
+struct governor {
+	int          version;	/* ESTD_GOVERNOR_VERSION */
+	const char  *name;
+	/* called for each domain when the governor becomes active */
+	int        (*init)(struct domain *);
+	/*
+	 * returns the new index into freqtab; estd clamps it to
+	 * [minidx, maxidx] and does the actual switching
+	 */
+	int        (*decide)(struct domain *, const struct sample *, useconds_t dt);
+	/* called for each domain when another governor takes over */
+	void       (*teardown)(struct domain *);
+};
+
+/*
+ * Status page (-Q file): estd keeps the file mapped and rewrites it after
+ * every poll. Readers map it read-only and copy what they need under the
+ * sequence counter, which is odd while an update is in progress:
+ *
+ *	do {
+ *		seq = st->seq;
+ *		(read barrier)
+ *		... copy fields ...
+ *		(read barrier)
+ *	} while ((seq & 1) || (seq != st->seq));
+ *
+ * Fields are only ever added at the end, with a new version.
+ */
+#define ESTD_STATUS_MAGIC	0x45535444	/* "ESTD" */
+#define ESTD_STATUS_VERSION	1
+#define ESTD_STATUS_DOMAINS	64	/* more are left out of the page */
+
+struct estd_domain_status {
+	int32_t      load;		/* percent, -1 if unknown */
+	int32_t      freqidx;	/* index into the frequency table */
+	int32_t      mhz;
+	int32_t      minmhz;
+	int32_t      maxmhz;
+	int32_t      thermalmhz;	/* thermal cap */
+	int32_t      overheat;	/* throttled by a sensor */
+	int32_t      temperature;	/* millidegrees C, 0 without sensors */
+	u_int32_t    lowtime;	/* us the load has been below low */
+	u_int32_t    ncpus;
+};
+
+struct estd_status {
+	u_int32_t    magic;		/* ESTD_STATUS_MAGIC */
+	u_int32_t    version;	/* ESTD_STATUS_VERSION */
+	u_int32_t    size;		/* sizeof(struct estd_status) */
+	volatile u_int32_t seq;
+	u_int64_t    polls;
+	u_int64_t    updated;	/* CLOCK_MONOTONIC us of the last update */
+	u_int32_t    pid;
+	u_int32_t    ndomains;	/* may exceed ESTD_STATUS_DOMAINS */
+	char         strategy[32];
+	struct estd_domain_status domain[ESTD_STATUS_DOMAINS];
+};
+
+/*
+ * Event dumps (-j file): a header followed by the events in the ring, oldest
+ * first, in the byte order of the machine that wrote them. Readers should
+ * skip the header by its size and step through the events by recsize.
+ */
+#define ESTD_EVENTS_MAGIC	0x45535445	/* "ESTE" */
+#define ESTD_EVENTS_VERSION	1
+
+/* why an event was recorded */
+#define ESTD_EVENT_UP		1	/* the governor sped up */
+#define ESTD_EVENT_DOWN		2	/* the governor slowed down */
+#define ESTD_EVENT_OVERHEAT	3	/* slowed down while overheating */
+#define ESTD_EVENT_THERMAL	4	/* held back by the thermal cap */
+#define ESTD_EVENT_LIMIT	5	/* held back by the minimum or maximum */
+#define ESTD_EVENT_CAP		6	/* the thermal cap moved */
+#define ESTD_EVENT_STRATEGY	7	/* another governor took over */
+#define ESTD_EVENT_TOPOLOGY	8	/* cpus came or went */
+#define ESTD_EVENT_LEASE	9	/* held up by a lease */
+
+#define ESTD_EVENT_REASONS { "none", "up", "down", "overheat", "thermal", \
+	"limit", "cap", "strategy", "topology", "lease" }
+
+struct estd_events_header {
+	u_int32_t    magic;		/* ESTD_EVENTS_MAGIC */
+	u_int32_t    version;	/* ESTD_EVENTS_VERSION */
+	u_int32_t    size;		/* sizeof(struct estd_events_header) */
+	u_int32_t    recsize;	/* sizeof(struct estd_event) */
+};
+
+struct estd_event {
+	u_int64_t    time;		/* us since estd started, simulated with -r and -N */
+	u_int32_t    seq;		/* 1 for the first event, in order */
+	int16_t      domain;	/* -1 for all of them */
+	u_int8_t     reason;	/* ESTD_EVENT_* */
+	int8_t       load;		/* percent, -1 if unknown */
+	int16_t      oldidx;	/* frequency index; governor for strategy, */
+	int16_t      newidx;	/* number of domains for topology events */
+	u_int16_t    oldmhz;	/* 0 if the indices are no frequencies */
+	u_int16_t    newmhz;
+};
+
+/* tunables from the command line */
+extern int        high;
+extern int        low;
+extern int        target;
+extern useconds_t lowgrace;
+extern int        verbose;
+extern int        daemonize;
+
+#endif /* _ESTD_H_ */
@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <regex.h>
+#include <sys/param.h>
+
+//#define TEST
+
+/*
+ * Sensors are named <chip>.<sensor> for matching against the -T pattern:
+ *
+ *    /sys/class/hwmon/hwmonN/temp<M>_input	<name>.temp<M>, and <name>.<label>
+ *						if there is a temp<M>_label
+ *    /sys/class/thermal/thermal_zoneN/temp	thermal_zoneN.<type>
+ *
+ * e.g.
+ *    "coretemp\.temp[0-9]+"	- every core of an Intel package
+ *    "coretemp\.Package"	- the package sensor only
+ *    "k10temp\.Tctl"		- AMD
+ *    "x86_pkg_temp|acpitz"	- thermal zones
+ */
+
+extern const char *sysfsroot;
+
+/* opendir, open and pread calls so far, read by estd.c after each check */
+unsigned long long overheat_calls;
+
+/* the sensors matching one device pattern, kept open and read with pread */
+struct sensorcache {
+	char			*device;
+	regex_t			 re;
+	int			*fds;
+	int			 nfds;
+	int			 ndevs;		/* at the last scan, -1 to scan again */
+	struct sensorcache	*next;
+};
+
+static struct sensorcache *caches;
+
+/* entries of dir whose name starts with prefix */
+static int
+count_entries(const char *dir, const char *prefix)
+{
+	char path[MAXPATHLEN];
+	struct dirent *de;
+	DIR *d;
+	int n = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", sysfsroot, dir);
+	overheat_calls++;
+	if ((d = opendir(path)) == NULL)
+		return 0;
+	while ((de = readdir(d)) != NULL)
+		if (strncmp(de->d_name, prefix, strlen(prefix)) == 0)
+			n++;
+	closedir(d);
+	return n;
+}
+
+/* hwmon chips and thermal zones, two directory reads */
+static int
+count_devices(void)
+{
+	return count_entries("class/hwmon", "hwmon") +
+	    count_entries("class/thermal", "thermal_zone");
+}
+
+/* read a short sysfs attribute, strip the newline */
+static int
+read_attr(const char *path, char *buf, size_t len)
+{
+	ssize_t n;
+	int fd;
+
+	overheat_calls++;
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+	if ((n > 0) && (buf[n - 1] == '\n'))
+		buf[n - 1] = '\0';
+	return 0;
+}
+
+static int
+match(struct sensorcache *sc, const char *chip, const char *sensor)
+{
+	char name[MAXPATHLEN];
+
+	snprintf(name, sizeof(name), "%s.%s", chip, sensor);
+	return regexec(&sc->re, name, 0, NULL, 0) == 0;
+}
+
+static void
+add_sensor(struct sensorcache *sc, const char *path, int *size)
+{
+	int fd;
+
+	overheat_calls++;
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return;
+	if (sc->nfds == *size) {
+		*size = *size ? *size * 2 : 8;
+		if ((sc->fds = realloc(sc->fds, *size * sizeof(int))) == NULL) {
+			fprintf(stderr, "estd: malloc: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+	sc->fds[sc->nfds++] = fd;
+}
+
+static void
+scan_sensors(struct sensorcache *sc)
+{
+	char path[MAXPATHLEN], chip[64], label[64], sensor[64];
+	struct dirent *de, *te;
+	DIR *dir, *tdir;
+	int n, size = 0;
+
+	while (sc->nfds > 0)
+		close(sc->fds[--sc->nfds]);
+	free(sc->fds);
+	sc->fds = NULL;
+	sc->ndevs = count_devices();
+
+	snprintf(path, sizeof(path), "%s/class/hwmon", sysfsroot);
+	overheat_calls++;
+	if ((dir = opendir(path)) != NULL) {
+		while ((de = readdir(dir)) != NULL) {
+			if (strncmp(de->d_name, "hwmon", 5) != 0)
+				continue;
+			snprintf(path, sizeof(path), "%s/class/hwmon/%s/name",
+			    sysfsroot, de->d_name);
+			if (read_attr(path, chip, sizeof(chip)) < 0)
+				continue;
+
+			snprintf(path, sizeof(path), "%s/class/hwmon/%s",
+			    sysfsroot, de->d_name);
+			overheat_calls++;
+			if ((tdir = opendir(path)) == NULL)
+				continue;
+			while ((te = readdir(tdir)) != NULL) {
+				if (sscanf(te->d_name, "temp%d", &n) != 1)
+					continue;
+				snprintf(sensor, sizeof(sensor), "temp%d_input", n);
+				if (strcmp(te->d_name, sensor) != 0)
+					continue;
+				snprintf(sensor, sizeof(sensor), "temp%d", n);
+				snprintf(path, sizeof(path), "%s/class/hwmon/%s/temp%d_label",
+				    sysfsroot, de->d_name, n);
+				if (!match(sc, chip, sensor) &&
+				    ((read_attr(path, label, sizeof(label)) < 0) ||
+				    !match(sc, chip, label)))
+					continue;
+				snprintf(path, sizeof(path), "%s/class/hwmon/%s/%s",
+				    sysfsroot, de->d_name, te->d_name);
+				add_sensor(sc, path, &size);
+			}
+			closedir(tdir);
+		}
+		closedir(dir);
+	}
+
+	snprintf(path, sizeof(path), "%s/class/thermal", sysfsroot);
+	overheat_calls++;
+	if ((dir = opendir(path)) != NULL) {
+		while ((de = readdir(dir)) != NULL) {
+			if (strncmp(de->d_name, "thermal_zone", 12) != 0)
+				continue;
+			snprintf(path, sizeof(path), "%s/class/thermal/%s/type",
+			    sysfsroot, de->d_name);
+			if ((read_attr(path, sensor, sizeof(sensor)) < 0) ||
+			    !match(sc, de->d_name, sensor))
+				continue;
+			snprintf(path, sizeof(path), "%s/class/thermal/%s/temp",
+			    sysfsroot, de->d_name);
+			add_sensor(sc, path, &size);
+		}
+		closedir(dir);
+	}
+
+	if (sc->nfds == 0)
+		fprintf(stderr, "estd: no sensor matches %s\n", sc->device);
+}
+
+static struct sensorcache *
+find_cache(const char *device)
+{
+	struct sensorcache *sc;
+
+	for (sc = caches; sc != NULL; sc = sc->next)
+		if (strcmp(sc->device, device) == 0)
+			return sc;
+
+	if ((sc = calloc(1, sizeof(*sc))) == NULL ||
+	    (sc->device = strdup(device)) == NULL) {
+		fprintf(stderr, "estd: malloc: %s\n", strerror(errno));
+		exit(1);
+	}
+	if (regcomp(&sc->re, device, REG_EXTENDED|REG_ICASE|REG_NOSUB) != 0) {
+		fprintf(stderr, "estd: invalid sensor pattern %s\n", device);
+		exit(1);
+	}
+	sc->ndevs = -1;
+	sc->next = caches;
+	caches = sc;
+	return sc;
+}
+
+/*
+ * called from the sensor thread in estd.c. The matching sensors are found
+ * once and kept open; the list is rebuilt when the number of hwmon chips or
+ * thermal zones changes and as soon as one of them can't be read anymore
+ * (e.g. a module was unloaded).
+ */
+int
+check_overheat(const char *device, double limit, double *degrees_ret)
+{
+	struct sensorcache *sc;
+	char buf[32];
+	double value, max = 0;
+	ssize_t len;
+	int i, overheated = 0;
+
+	sc = find_cache(device);
+	if ((sc->ndevs < 0) || (count_devices() != sc->ndevs))
+		scan_sensors(sc);
+	if (sc->nfds == 0)
+		return -1;
+
+	for (i = 0; i < sc->nfds; i++) {
+		overheat_calls++;
+		if ((len = pread(sc->fds[i], buf, sizeof(buf) - 1, 0)) <= 0) {
+			sc->ndevs = -1;
+			continue;
+		}
+		buf[len] = '\0';
+		value = atoi(buf) / 1000.0;	/* millidegrees */
+
+#ifdef TEST
+		printf("check: %d=%.2f > %.2f\n", i, value, limit);
+#endif
+
+		if (value > max)
+			max = value;
+		if (value >= limit)
+			overheated = 1;
+	}
+
+	if (degrees_ret != NULL)
+		*degrees_ret = max;
+
+	return overheated;
+}
+
+#ifdef TEST
+const char *sysfsroot = "/sys";
+
+int
+main(int argc, char *argv[])
+{
+	int fire;
+
+	if (argc > 2)
+		sysfsroot = argv[2];
+	for (;;) {
+		fire = check_overheat(argc > 1 ? argv[1] : "coretemp|k10temp|x86_pkg_temp", 65.0, NULL);
+		printf("overheat=%d\n", fire);
+		fflush(stdout);
+
+		sleep(1);
+	}
+}
+#endif
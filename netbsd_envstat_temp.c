@@ -17,65 +17,6 @@
 #define _PATH_SYSMON "/dev/sysmon"
 #endif
 
-static void
-prop_iterate0(void (*cbfunc)(void *, const char *, prop_object_t), char *cbarg, char *key, size_t keylen, prop_object_t parent, prop_object_t obj)
-{
-	prop_object_iterator_t itr;
-	prop_object_t obj2;
-	const char *p;
-	char *k;
-
-	switch (prop_object_type(obj)) {
-	case PROP_TYPE_BOOL:
-	case PROP_TYPE_NUMBER:
-	case PROP_TYPE_STRING:
-	case PROP_TYPE_DATA:
-		(*cbfunc)(cbarg, key, obj);
-		break;
-
-	case PROP_TYPE_ARRAY:
-		itr = prop_array_iterator(obj);
-		for (obj2 = prop_object_iterator_next(itr); obj2 != NULL;
-		    obj2 = prop_object_iterator_next(itr)) {
-			prop_iterate0(cbfunc, cbarg, key, keylen, obj, obj2);
-		}
-		prop_object_iterator_release(itr);
-		break;
-	case PROP_TYPE_DICTIONARY:
-		itr = prop_dictionary_iterator(obj);
-		for (obj2 = prop_object_iterator_next(itr); obj2 != NULL;
-		    obj2 = prop_object_iterator_next(itr)) {
-			prop_iterate0(cbfunc, cbarg, key, keylen, obj, obj2);
-		}
-		prop_object_iterator_release(itr);
-		break;
-	case PROP_TYPE_DICT_KEYSYM:
-		p = prop_dictionary_keysym_cstring_nocopy(obj);
-		k = key + strlen(key);
-		if (key[0] != '\0')
-			strlcat(key, ".", keylen);
-		strlcat(key, p, keylen);
-		obj2 = prop_dictionary_get_keysym(parent, obj);
-		prop_iterate0(cbfunc, cbarg, key, keylen, obj, obj2);
-		*k = '\0';
-		break;
-	default:
-		fprintf(stderr, "estd: UNKNOWN PROP TYPE\n");
-		break;
-	}
-}
-
-static void
-prop_iterate(void (*cbfunc)(void *, const char *, prop_object_t), char *cbarg, prop_object_t obj)
-{
-	char *key;
-	size_t keylen = 1024;
-	key = alloca(keylen);
-	key[0] = '\0';
-	prop_iterate0(cbfunc, cbarg, key, keylen, NULL, obj);
-}
-
-
 char *
 freadin(FILE *fh)
 {
@@ -125,94 +66,168 @@ freadin(FILE *fh)
 	return buf;
 }
 
-struct keychecker {
-	regex_t re;
-	double limit;
-	double max;
-	int result;
+#define SENSOR_KEY "cur-value"
+
+/* a sensor is an entry of the array the dictionary holds for its device */
+struct sensorkey {
+	char		*dev;
+	unsigned int	 idx;
 };
 
+/* the sensors matching one device pattern, found once and then looked up directly */
+struct sensorcache {
+	char			*device;
+	int			 use_envstat;
+	regex_t			 re;
+	struct sensorkey	*keys;
+	int			 nkeys;
+	int			 nsensors;	/* in the dictionary we scanned, -1 to rescan */
+	struct sensorcache	*next;
+};
+
+static struct sensorcache *caches;
+
+/* envstat runs and sysmon ioctls so far, read by estd.c after each check */
+unsigned long long overheat_calls;
+
+/* number of sensors in the dictionary, a change means the list is stale */
+static int
+count_sensors(prop_dictionary_t dict)
+{
+	prop_object_iterator_t itr;
+	prop_object_t keysym, obj;
+	int n = 0;
+
+	itr = prop_dictionary_iterator(dict);
+	while ((keysym = prop_object_iterator_next(itr)) != NULL) {
+		obj = prop_dictionary_get_keysym(dict, keysym);
+		if (prop_object_type(obj) == PROP_TYPE_ARRAY)
+			n += prop_array_count(obj);
+	}
+	prop_object_iterator_release(itr);
+
+	return n;
+}
+
 static void
-prop_check_callback(void *arg, const char *key, prop_object_t obj)
+scan_sensors(struct sensorcache *sc, prop_dictionary_t dict)
 {
-	struct keychecker *keychecker;
+	prop_object_iterator_t itr;
+	prop_object_t keysym, obj, sensor, value;
 	regmatch_t re_pmatch[1];
-	double degrees;
-	uint64_t num;
+	const char *dev;
+	char key[256];
+	unsigned int idx;
+	int n = 0;
+
+	while (sc->nkeys > 0)
+		free(sc->keys[--sc->nkeys].dev);
+	free(sc->keys);
+	sc->keys = NULL;
+
+	itr = prop_dictionary_iterator(dict);
+	while ((keysym = prop_object_iterator_next(itr)) != NULL) {
+		dev = prop_dictionary_keysym_cstring_nocopy(keysym);
+		obj = prop_dictionary_get_keysym(dict, keysym);
+		if (prop_object_type(obj) != PROP_TYPE_ARRAY)
+			continue;
+
+		snprintf(key, sizeof(key), "%s." SENSOR_KEY, dev);
+		re_pmatch[0].rm_so = 0;
+		re_pmatch[0].rm_eo = strlen(key);
+		if (regexec(&sc->re, key, 1, re_pmatch, REG_STARTEND) != 0)
+			continue;
+
+		for (idx = 0; idx < prop_array_count(obj); idx++) {
+			sensor = prop_array_get(obj, idx);
+			if (prop_object_type(sensor) != PROP_TYPE_DICTIONARY)
+				continue;
+			value = prop_dictionary_get(sensor, SENSOR_KEY);
+			if (prop_object_type(value) != PROP_TYPE_NUMBER)
+				continue;
+
+			if (sc->nkeys == n) {
+				n = n ? n * 2 : 8;
+				if ((sc->keys = realloc(sc->keys, n * sizeof(*sc->keys))) == NULL) {
+					fprintf(stderr, "estd: malloc: %s\n", strerror(errno));
+					exit(1);
+				}
+			}
+			if ((sc->keys[sc->nkeys].dev = strdup(dev)) == NULL) {
+				fprintf(stderr, "estd: malloc: %s\n", strerror(errno));
+				exit(1);
+			}
+			sc->keys[sc->nkeys++].idx = idx;
+		}
+	}
+	prop_object_iterator_release(itr);
 
-	keychecker = (struct keychecker *)arg;
+	sc->nsensors = count_sensors(dict);
+}
 
-	re_pmatch[0].rm_so = 0;
-	re_pmatch[0].rm_eo = strlen(key);
-	if (regexec(&keychecker->re, key, 1, re_pmatch, REG_STARTEND) != 0)
-		return;
+static struct sensorcache *
+find_cache(const char *device)
+{
+	struct sensorcache *sc;
+	char pattern[128];
 
-	switch (prop_object_type(obj)) {
-	case PROP_TYPE_BOOL:
-#ifdef TEST
-		fprintf(stderr, "%s=%s\n", key, prop_bool_true(obj) ? "true" : "false");
-#endif
-		break;
-	case PROP_TYPE_NUMBER:
-		num = prop_number_unsigned_integer_value(obj);
-		num -= 273150000;
-		degrees = num / 1000000;
-		if (degrees >= keychecker->limit)
-			keychecker->result = 1;
-		if (keychecker->max < degrees)
-			keychecker->max = degrees;
-		break;
-	case PROP_TYPE_STRING:
-#ifdef TEST
-		{
-			const char *p;
-			p = prop_string_cstring_nocopy(obj);
-			fprintf(stderr, "%s=\"%s\"\n", key, p);
-		}
-#endif
-		break;
-	case PROP_TYPE_DATA:
-#ifdef TEST
-		fprintf(stderr, "%s=<PROP_TYPE_DATA>\n", key);
-#endif
-		break;
-	default:
-#ifdef TEST
-		fprintf(stderr, "%s: UNKNOWN PROP TYPE\n", key);
-#endif
-		break;
+	for (sc = caches; sc != NULL; sc = sc->next)
+		if (strcmp(sc->device, device) == 0)
+			return sc;
+
+	if ((sc = calloc(1, sizeof(*sc))) == NULL ||
+	    (sc->device = strdup(device)) == NULL) {
+		fprintf(stderr, "estd: malloc: %s\n", strerror(errno));
+		exit(1);
 	}
+	if (strncmp(device, "envstat:", 8) == 0) {
+		sc->use_envstat = 1;
+		device += sizeof("envstat:") - 1;
+	}
+	snprintf(pattern, sizeof(pattern), "%s\\." SENSOR_KEY, device);
+	if (regcomp(&sc->re, pattern, REG_EXTENDED|REG_ICASE) != 0) {
+		fprintf(stderr, "estd: invalid sensor pattern %s\n", device);
+		exit(1);
+	}
+	sc->nsensors = -1;
+	sc->next = caches;
+	caches = sc;
+	return sc;
 }
 
-static int
+/*
+ * called from the sensor thread in estd.c.
+ *
+ * <device> is able to specified as regexp.
+ *
+ * if <device> has prefix "envstat:",
+ * exec "/usr/sbin/envstat -c /etc/envstat.conf -x" and read from it.
+ * otherwise, read from /dev/sysmon directly.
+ *
+ * e.g.
+ *    "envstat:MyTempSensor0" - exec "envstat -c /etc/envstat.conf -x" and read from it
+ *    "envstat:coretemp0"     - ditto
+ *    "coretemp0"             - read coretemp0 from /dev/sysmon
+ *    "coretemp[0-9]+"        - read coretemp0,1,2,... from /dev/sysmon
+ *
+ * The pattern is compiled and the matching sensors are looked for only
+ * once; they are looked up again when the number of sensors changes.
+ */
+int
 check_overheat(const char *device, double limit, double *degrees_ret)
 {
-	prop_object_t propobj;
-	struct keychecker keychecker;
+	struct sensorcache *sc;
+	prop_object_t propobj, obj;
 	FILE *fh;
-	int fd, rc, use_envstat = 0;
-	char pattern[128];
+	double degrees, max = 0;
+	uint64_t num;
+	int fd, i, rc, result = 0;
 	char *xml;
 
-	/*
-	 * <device> is able to specified as regexp.
-	 *
-	 * if <device> has prefix "envstat:",
-	 * exec "/usr/sbin/envstat -c /etc/envstat.conf -x" and read from it.
-	 * otherwise, read from /dev/sysmon directly.
-	 *
-	 * e.g.
-	 *    "envstat:MyTempSensor0" - exec "envstat -c /etc/envstat.conf -x" and read from it
-	 *    "envstat:coretemp0"     - ditto
-	 *    "coretemp0"             - read coretemp0 from /dev/sysmon
-	 *    "coretemp[0-9]+"        - read coretemp0,1,2,... from /dev/sysmon
-	 */
-	if (strncmp(device, "envstat:", 8) == 0) {
-		use_envstat = 1;
-		device += sizeof("envstat:") - 1;
-	}
+	sc = find_cache(device);
+	overheat_calls++;
 
-	if (use_envstat) {
+	if (sc->use_envstat) {
 		/* exec "envstat -x" and parse */
 		fh = popen(CMD_ENVSTAT " -x", "r");
 		if (fh == NULL) {
@@ -242,38 +257,30 @@ check_overheat(const char *device, double limit, double *degrees_ret)
 		return -1;
 	}
 
-	memset(&keychecker, 0, sizeof(keychecker));
-	snprintf(pattern, sizeof(pattern), "%s\\.cur-value", device);
-
-	rc = regcomp(&keychecker.re, pattern, REG_EXTENDED|REG_ICASE);
-	keychecker.limit = limit;
-	keychecker.max = 0;
-
-	prop_iterate(prop_check_callback, (void *)&keychecker, propobj);
+	if (sc->nsensors != count_sensors(propobj))
+		scan_sensors(sc, propobj);
+
+	for (i = 0; i < sc->nkeys; i++) {
+		obj = prop_dictionary_get(propobj, sc->keys[i].dev);
+		obj = prop_array_get(obj, sc->keys[i].idx);
+		obj = prop_dictionary_get(obj, SENSOR_KEY);
+		if (prop_object_type(obj) != PROP_TYPE_NUMBER) {
+			/* the sensor moved, look again next time */
+			sc->nsensors = -1;
+			continue;
+		}
+		num = prop_number_unsigned_integer_value(obj);
+		num -= 273150000;
+		degrees = num / 1000000;
+		if (degrees >= limit)
+			result = 1;
+		if (max < degrees)
+			max = degrees;
+	}
 	prop_object_release(propobj);
 
-	regfree(&keychecker.re);
-
 	if (degrees_ret != NULL)
-		*degrees_ret = keychecker.max;
-
-	return keychecker.result;
-}
-
-int
-is_overheat(const char *device, double degrees, unsigned int cachetime, double *degrees_ret)
-{
-	static struct timespec ts_last, ts_now;
-	static int result;
-
-	if (device == NULL)
-		return 0;
-
-	clock_gettime(CLOCK_MONOTONIC, &ts_now);
-	if ((ts_now.tv_sec - ts_last.tv_sec) > cachetime) {
-		result = check_overheat(device, degrees, degrees_ret);
-		ts_last = ts_now;
-	}
+		*degrees_ret = max;
 
 	return result;
 }
@@ -285,11 +292,11 @@ main(int argc, char *argv[])
 	int fire;
 
 	for (;;) {
-		fire = check_overheat("envstat:coretemp[0-9]+", 59.0);
+		fire = check_overheat("envstat:coretemp[0-9]+", 59.0, NULL);
 		printf("overheat with envstat=%d\n", fire);
 		fflush(stdout);
 
-		fire = check_overheat("coretemp[0-9]+", 59.0);
+		fire = check_overheat("coretemp[0-9]+", 59.0, NULL);
 		printf("overheat with sysmon=%d\n", fire);
 
 		sleep(1);
@@ -16,92 +16,175 @@
 
 #define SYSCTL_BUFSIZ 8192
 
+/* the sensors matching one device pattern, found once and then read directly */
+struct sensorcache {
+	char			*device;
+	regex_t			 re;
+	int			(*mibs)[5];
+	int			 nmibs;
+	int			 ndevs;		/* at the last scan, -1 to scan again */
+	struct sensorcache	*next;
+};
+
+static struct sensorcache *caches;
+
+/* sysctl calls so far, read by estd.c after each check */
+unsigned long long overheat_calls;
+
+/* number of attached sensor devices, one sysctl each */
 static int
-check_overheat(const char *device, double limit, double *degrees_ret)
+count_devices(void)
+{
+	struct sensordev sensordev;
+	size_t sensordev_len = sizeof(sensordev);
+	int mib[] = {CTL_HW, HW_SENSORS, 0};
+	int dev, n = 0;
+
+	for (dev = 0;; dev++) {
+		mib[2] = dev;
+		overheat_calls++;
+		if (sysctl(mib, 3, &sensordev, &sensordev_len, NULL, 0) < 0) {
+			if (errno == ENXIO)
+				continue;
+			break;
+		}
+		n++;
+	}
+	return n;
+}
+
+static int
+scan_sensors(struct sensorcache *sc)
 {
-	regex_t re;
 	regmatch_t re_pmatch[1];
 	struct sensordev sensordev;
 	struct sensor sensor;
 	size_t sensordev_len = sizeof(sensordev);
 	size_t sensor_len = sizeof(sensor);
-	double value;
 	int mib[] = {CTL_HW, HW_SENSORS, 0, 0, 0};
-	int dev, j, rc, overheated = 0;
+	int dev, j, n = 0;
 	char sysctlname[SYSCTL_BUFSIZ];
-	char pattern[128];
 
-	rc = regcomp(&re, device, REG_EXTENDED|REG_ICASE);
-
-	if (degrees_ret != NULL)
-		*degrees_ret = 0;
+	free(sc->mibs);
+	sc->mibs = NULL;
+	sc->nmibs = 0;
+	sc->ndevs = 0;
 
 	for (dev = 0;; dev++) {
 		mib[2] = dev;
+		overheat_calls++;
 		if (sysctl(mib, 3, &sensordev, &sensordev_len, NULL, 0) < 0) {
 			if (errno == ENXIO)
 				continue;
 			break;
 		}
+		sc->ndevs++;
 
-		mib[2] = dev;
 		mib[3] = SENSOR_TEMP;
 		for (j = 0; j < sensordev.maxnumt[SENSOR_TEMP]; j++) {
 			mib[4] = j;
+			overheat_calls++;
 			if (sysctl(mib, 5, &sensor, &sensor_len, NULL, 0) < 0) {
 				fprintf(stderr, "sysctl: hw.sensors.%s.temp%d: %s\n", sensordev.xname, j, strerror(errno));
 				continue;
 			}
 
-			if (sensor.flags & SENSOR_FINVALID)
-				continue;
-
 			snprintf(sysctlname, sizeof(sysctlname) - 1,
 			    "hw.sensors.%s.temp%d", sensordev.xname, j);
 
 			re_pmatch[0].rm_so = 0;
 			re_pmatch[0].rm_eo = strlen(sysctlname);
-			if (regexec(&re, sysctlname, 1, re_pmatch, REG_STARTEND) != 0)
+			if (regexec(&sc->re, sysctlname, 1, re_pmatch, REG_STARTEND) != 0)
 				continue;
 
-			value = (sensor.value - 273150000) / 1000000.0;
-
-			if ((degrees_ret != NULL) && (value > *degrees_ret))
-				*degrees_ret = value;
-
-#ifdef TEST
-			printf("check: %s=%.2f > %.2f\n", sysctlname, value, limit);
-#endif
-
-			if (value >= limit) {
-				overheated = 1;
-				if (degrees_ret == NULL)
-					goto done;
+			if (sc->nmibs == n) {
+				n = n ? n * 2 : 8;
+				if ((sc->mibs = realloc(sc->mibs, n * sizeof(*sc->mibs))) == NULL) {
+					fprintf(stderr, "estd: malloc: %s\n", strerror(errno));
+					exit(1);
+				}
 			}
+			memcpy(sc->mibs[sc->nmibs++], mib, sizeof(mib));
 		}
 	}
- done:
-	regfree(&re);
 
-	return overheated;
+	return sc->nmibs;
 }
 
+static struct sensorcache *
+find_cache(const char *device)
+{
+	struct sensorcache *sc;
+
+	for (sc = caches; sc != NULL; sc = sc->next)
+		if (strcmp(sc->device, device) == 0)
+			return sc;
+
+	if ((sc = calloc(1, sizeof(*sc))) == NULL ||
+	    (sc->device = strdup(device)) == NULL) {
+		fprintf(stderr, "estd: malloc: %s\n", strerror(errno));
+		exit(1);
+	}
+	if (regcomp(&sc->re, device, REG_EXTENDED|REG_ICASE) != 0) {
+		fprintf(stderr, "estd: invalid sensor pattern %s\n", device);
+		exit(1);
+	}
+	sc->ndevs = -1;
+	sc->next = caches;
+	caches = sc;
+	return sc;
+}
+
+/*
+ * called from the sensor thread in estd.c. Walking all sensors takes one
+ * sysctl per sensor, so the matching ones are remembered and only they are
+ * read; the list is rebuilt when the number of sensor devices changes or
+ * one of them can't be read anymore.
+ */
 int
-is_overheat(const char *device, double degrees, unsigned int cachetime, double *degrees_ret)
+check_overheat(const char *device, double limit, double *degrees_ret)
 {
-	static struct timespec ts_last, ts_now;
-	static int result;
+	struct sensorcache *sc;
+	struct sensor sensor;
+	size_t sensor_len = sizeof(sensor);
+	double value;
+	int i, overheated = 0;
 
-	if (device == NULL)
-		return 0;
+	sc = find_cache(device);
+	if ((sc->ndevs < 0) || (count_devices() != sc->ndevs))
+		scan_sensors(sc);
 
-	clock_gettime(CLOCK_MONOTONIC, &ts_now);
-	if ((ts_now.tv_sec - ts_last.tv_sec) > cachetime) {
-		result = check_overheat(device, degrees, degrees_ret);
-		ts_last = ts_now;
+	if (degrees_ret != NULL)
+		*degrees_ret = 0;
+
+	for (i = 0; i < sc->nmibs; i++) {
+		overheat_calls++;
+		if (sysctl(sc->mibs[i], 5, &sensor, &sensor_len, NULL, 0) < 0) {
+			/* the sensor is gone, look again next time */
+			sc->ndevs = -1;
+			continue;
+		}
+
+		if (sensor.flags & SENSOR_FINVALID)
+			continue;
+
+		value = (sensor.value - 273150000) / 1000000.0;
+
+		if ((degrees_ret != NULL) && (value > *degrees_ret))
+			*degrees_ret = value;
+
+#ifdef TEST
+		printf("check: %d.%d=%.2f > %.2f\n", sc->mibs[i][2], sc->mibs[i][4], value, limit);
+#endif
+
+		if (value >= limit) {
+			overheated = 1;
+			if (degrees_ret == NULL)
+				break;
+		}
 	}
 
-	return result;
+	return overheated;
 }
 
 #ifdef TEST
@@ -111,7 +194,7 @@ main(int argc, char *argv[])
 	int fire;
 
 	for (;;) {
-		fire = check_overheat("hw\\.sensors\\.(cpu|acpitz|itherm)[0-9]+\\.temp[0-9]+", 65.0);
+		fire = check_overheat("hw\\.sensors\\.(cpu|acpitz|itherm)[0-9]+\\.temp[0-9]+", 65.0, NULL);
 		printf("overheat=%d\n", fire);
 		fflush(stdout);
 